@@ -9,20 +9,38 @@
  *     Peter Maydell (Linaro) - initial implementation
  ******************************************************************************/
 
-/* Routines for the socket communication between master and apprentice. */
+/* Routines for the communication between master and apprentice. */
 
 #include "risu.h"
 
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #ifndef RISU_MACOS9
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
 #endif
 
 #ifndef RISU_MACOS9
@@ -52,7 +70,7 @@ int apprentice_connect(const char *hostname, int port)
     return sock;
 }
 
-int master_connect(int port)
+int master_listen(int port, int backlog)
 {
     int sock;
     struct sockaddr_in sa;
@@ -75,26 +93,647 @@ int master_connect(int port)
         perror("bind");
         exit(EXIT_FAILURE);
     }
-    if (listen(sock, 1) < 0) {
+    if (listen(sock, backlog) < 0) {
         perror("listen");
         exit(EXIT_FAILURE);
     }
+    return sock;
+}
+
+int master_accept(int sock)
+{
     /* Just block until we get a connection */
-    fprintf(stderr, "master: waiting for connection on port %d...\n",
-            port);
     struct sockaddr_in csa;
     socklen_t csasz = sizeof(csa);
-    int nsock = accept(sock, (struct sockaddr *) &csa, &csasz);
+    int nsock;
+    do {
+        nsock = accept(sock, (struct sockaddr *) &csa, &csasz);
+    } while (nsock < 0 && errno == EINTR);
     if (nsock < 0) {
         perror("accept");
         exit(EXIT_FAILURE);
     }
+    fprintf(stderr, "master: connection from %s:%d\n",
+            inet_ntoa(csa.sin_addr), ntohs(csa.sin_port));
+    return nsock;
+}
+
+int master_connect(int port)
+{
+    int sock = master_listen(port, 1);
+    int nsock;
+
+    fprintf(stderr, "master: waiting for connection on port %d...\n",
+            port);
+    nsock = master_accept(sock);
     /* We're done with the server socket now */
     close(sock);
     return nsock;
 }
 #endif
 
+#ifndef RISU_MACOS9
+/* Shared memory transport.
+ *
+ * When master and apprentice run on the same host they can talk
+ * through a pair of single-producer single-consumer byte rings in a
+ * shared file mapping instead of a socket. The rings carry exactly
+ * the byte streams that would go over the socket, so the packet
+ * routines further down don't care which transport is in use.
+ *
+ * All the shared words are kept in network byte order, so that an
+ * apprentice running under a foreign-endian emulator can share the
+ * mapping with a native master.
+ */
+
+#define SHM_MAGIC       0x52534d31      /* "RSM1" */
+#define SHM_DATA_SIZE   (1 << 20)       /* master to apprentice */
+#define SHM_RESP_SIZE   4096            /* apprentice to master */
+#define SHM_SPIN        1000
+
+enum {
+    RING_TO_APPRENTICE = 0, RING_TO_MASTER = 1
+};
+
+typedef struct {
+    uint32_t head;              /* consumer position */
+    uint32_t tail;              /* producer position */
+    uint32_t rd_wait;           /* consumer sleeps on tail */
+    uint32_t wr_wait;           /* producer sleeps on head */
+    uint32_t size;              /* power of 2 */
+    uint32_t offset;            /* of the data from the channel start */
+    uint32_t pad[10];
+} shm_ring;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t attached;
+    uint32_t pid[2];            /* master, apprentice */
+    uint32_t pad[12];
+    shm_ring ring[2];
+} shm_channel;
+
+static RISU_TLS shm_channel *shm;
+static RISU_TLS int shm_fd = -1;
+static RISU_TLS bool shm_master;
+static RISU_TLS int shm_spin;
+
+static uint32_t shm_load(uint32_t *p)
+{
+    return ntohl(__atomic_load_n(p, __ATOMIC_SEQ_CST));
+}
+
+static void shm_store(uint32_t *p, uint32_t val)
+{
+    __atomic_store_n(p, htonl(val), __ATOMIC_SEQ_CST);
+}
+
+/* Sleep while *p still holds val, for at most a second. */
+static void shm_futex_wait(uint32_t *p, uint32_t val)
+{
+#ifdef __linux__
+    struct timespec ts = { 1, 0 };
+    syscall(SYS_futex, p, FUTEX_WAIT, htonl(val), &ts, NULL, 0);
+#else
+    usleep(20);
+#endif
+}
+
+static void shm_futex_wake(uint32_t *p)
+{
+#ifdef __linux__
+    syscall(SYS_futex, p, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+/* Wait until *p no longer holds val. Returns false if we are not
+ * allowed to block, or if the other side has gone away.
+ */
+static bool shm_wait_change(uint32_t *p, uint32_t val, uint32_t *waiting,
+                            bool block)
+{
+    int i;
+    pid_t peer;
+
+    for (i = 0; i < shm_spin; i++) {
+        if (shm_load(p) != val) {
+            return true;
+        }
+        if (!block) {
+            return false;
+        }
+    }
+    peer = shm_load(&shm->pid[shm_master ? 1 : 0]);
+    for (;;) {
+        shm_store(waiting, 1);
+        if (shm_load(p) != val) {
+            break;
+        }
+        shm_futex_wait(p, val);
+        if (shm_load(p) == val && kill(peer, 0) != 0 && errno == ESRCH) {
+            shm_store(waiting, 0);
+            return false;
+        }
+    }
+    shm_store(waiting, 0);
+    return true;
+}
+
+static uint8_t *shm_ring_data(shm_ring *r)
+{
+    return (uint8_t *)shm + shm_load(&r->offset);
+}
+
+/* Read up to len bytes. Returns 0 if the master or apprentice went
+ * away, or -1 with EAGAIN if there is nothing to read and !block.
+ */
+static ssize_t shm_read(void *buf, size_t len, bool block)
+{
+    shm_ring *r = &shm->ring[shm_master ? RING_TO_MASTER : RING_TO_APPRENTICE];
+    uint32_t size = shm_load(&r->size);
+    uint32_t head = shm_load(&r->head);
+    uint32_t pos, n, first;
+
+    if (!shm_wait_change(&r->tail, head, &r->rd_wait, block)) {
+        if (!block) {
+            errno = EAGAIN;
+            return -1;
+        }
+        return 0;
+    }
+    n = shm_load(&r->tail) - head;
+    if (n > len) {
+        n = len;
+    }
+    pos = head & (size - 1);
+    first = n < size - pos ? n : size - pos;
+    memcpy(buf, shm_ring_data(r) + pos, first);
+    memcpy((uint8_t *)buf + first, shm_ring_data(r), n - first);
+
+    shm_store(&r->head, head + n);
+    if (shm_load(&r->wr_wait)) {
+        shm_futex_wake(&r->head);
+    }
+    return n;
+}
+
+static ssize_t shm_write(const void *buf, size_t len)
+{
+    shm_ring *r = &shm->ring[shm_master ? RING_TO_APPRENTICE : RING_TO_MASTER];
+    uint32_t size = shm_load(&r->size);
+    const uint8_t *p = (const uint8_t *)buf;
+    size_t left = len;
+
+    while (left) {
+        uint32_t tail = shm_load(&r->tail);
+        uint32_t head = shm_load(&r->head);
+        uint32_t pos, n, first;
+
+        if (tail - head == size) {
+            if (!shm_wait_change(&r->head, head, &r->wr_wait, true)) {
+                errno = EPIPE;
+                return -1;
+            }
+            continue;
+        }
+        n = size - (tail - head);
+        if (n > left) {
+            n = left;
+        }
+        pos = tail & (size - 1);
+        first = n < size - pos ? n : size - pos;
+        memcpy(shm_ring_data(r) + pos, p, first);
+        memcpy(shm_ring_data(r), p + first, n - first);
+
+        shm_store(&r->tail, tail + n);
+        if (shm_load(&r->rd_wait)) {
+            shm_futex_wake(&r->tail);
+        }
+        p += n;
+        left -= n;
+    }
+    return len;
+}
+
+static size_t shm_channel_size(void)
+{
+    return sizeof(shm_channel) + SHM_DATA_SIZE + SHM_RESP_SIZE;
+}
+
+static void shm_setup(shm_channel *ch, int fd, bool master)
+{
+    shm = ch;
+    shm_fd = fd;
+    shm_master = master;
+    /* Spinning only helps if the other side can run meanwhile. */
+    shm_spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN : 1;
+}
+
+int shm_master_create(const char *path)
+{
+    char *tmp;
+    int fd;
+    shm_channel *ch;
+
+    /* Build the channel under a temporary name and rename it into
+     * place, so the apprentice never sees it half initialised.
+     */
+    tmp = (char *)malloc(strlen(path) + 32);
+    sprintf(tmp, "%s.%d", path, (int)getpid());
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+    if (ftruncate(fd, shm_channel_size()) != 0) {
+        perror("ftruncate");
+        exit(EXIT_FAILURE);
+    }
+    ch = (shm_channel *)mmap(NULL, shm_channel_size(), PROT_READ | PROT_WRITE,
+                             MAP_SHARED, fd, 0);
+    if (ch == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    shm_setup(ch, fd, true);
+
+    shm_store(&ch->ring[RING_TO_APPRENTICE].size, SHM_DATA_SIZE);
+    shm_store(&ch->ring[RING_TO_APPRENTICE].offset, sizeof(shm_channel));
+    shm_store(&ch->ring[RING_TO_MASTER].size, SHM_RESP_SIZE);
+    shm_store(&ch->ring[RING_TO_MASTER].offset,
+              sizeof(shm_channel) + SHM_DATA_SIZE);
+    shm_store(&ch->pid[0], getpid());
+    shm_store(&ch->magic, SHM_MAGIC);
+
+    if (rename(tmp, path) != 0) {
+        perror("rename");
+        exit(EXIT_FAILURE);
+    }
+    free(tmp);
+    return fd;
+}
+
+void shm_master_wait(const char *path)
+{
+    /* Just block until the apprentice turns up */
+    fprintf(stderr, "master: waiting for apprentice on %s...\n", path);
+    while (!shm_load(&shm->attached)) {
+        shm_futex_wait(&shm->attached, 0);
+    }
+    /* Nobody else should find it now */
+    unlink(path);
+}
+
+int shm_master_connect(const char *path)
+{
+    int fd = shm_master_create(path);
+    shm_master_wait(path);
+    return fd;
+}
+
+int shm_apprentice_connect(const char *path)
+{
+    struct stat st;
+    int fd;
+    shm_channel *ch;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+    if (fstat(fd, &st) != 0) {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+    if (st.st_size != shm_channel_size()) {
+        fprintf(stderr, "%s is not a risu shared memory channel\n", path);
+        exit(EXIT_FAILURE);
+    }
+    ch = (shm_channel *)mmap(NULL, shm_channel_size(), PROT_READ | PROT_WRITE,
+                             MAP_SHARED, fd, 0);
+    if (ch == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    if (shm_load(&ch->magic) != SHM_MAGIC) {
+        fprintf(stderr, "%s is not a risu shared memory channel\n", path);
+        exit(EXIT_FAILURE);
+    }
+    shm_setup(ch, fd, false);
+
+    shm_store(&ch->pid[1], getpid());
+    shm_store(&ch->attached, 1);
+    shm_futex_wake(&ch->attached);
+    return fd;
+}
+#endif
+
+#ifndef RISU_MACOS9
+/* Wire compression.
+ *
+ * Once comm_set_compression() has been called, every data packet is
+ * sent as its raw length, its compressed length and the compressed
+ * bytes. Each direction is one compression stream, flushed at the end
+ * of every packet, so later packets can refer back to earlier ones.
+ * Response bytes are never compressed.
+ */
+static RISU_TLS int comp_algo = COMM_COMPRESS_NONE;
+static RISU_TLS uint8_t *comp_buf, *plain_buf;
+static RISU_TLS size_t comp_cap, plain_cap;
+
+#ifdef HAVE_ZSTD
+#define ZSTD_WIRE_LEVEL 1
+
+static RISU_TLS ZSTD_CCtx *zstd_c;
+static RISU_TLS ZSTD_DCtx *zstd_d;
+#endif
+
+#ifdef HAVE_LZ4
+/* LZ4 streams need the last 64K of data to stay put, so packets are
+ * copied into a ring first, in pieces of at most LZ4_PIECE bytes. The
+ * decoder keeps an identical ring.
+ */
+#define LZ4_PIECE (64 * 1024)
+#define LZ4_RING  (64 * 1024 + LZ4_PIECE)
+
+static RISU_TLS LZ4_stream_t *lz4_c;
+static RISU_TLS LZ4_streamDecode_t *lz4_d;
+static RISU_TLS char *lz4_cring, *lz4_dring;
+static RISU_TLS size_t lz4_cpos, lz4_dpos;
+#endif
+
+static void *comp_reserve(uint8_t **buf, size_t *cap, size_t len)
+{
+    if (len > *cap) {
+        *buf = (uint8_t *)realloc(*buf, len);
+        if (!*buf) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        *cap = len;
+    }
+    return *buf;
+}
+
+int comm_compress_supported(void)
+{
+    int mask = 1 << COMM_COMPRESS_NONE;
+#ifdef HAVE_LZ4
+    mask |= 1 << COMM_COMPRESS_LZ4;
+#endif
+#ifdef HAVE_ZSTD
+    mask |= 1 << COMM_COMPRESS_ZSTD;
+#endif
+    return mask;
+}
+
+const char *comm_compress_name(int algo)
+{
+    switch (algo) {
+    case COMM_COMPRESS_NONE:
+        return "none";
+    case COMM_COMPRESS_LZ4:
+        return "lz4";
+    case COMM_COMPRESS_ZSTD:
+        return "zstd";
+    }
+    return "unknown";
+}
+
+int comm_set_compression(int algo)
+{
+    if (!(comm_compress_supported() & (1 << algo))) {
+        return -1;
+    }
+    switch (algo) {
+#ifdef HAVE_ZSTD
+    case COMM_COMPRESS_ZSTD:
+        zstd_c = ZSTD_createCCtx();
+        zstd_d = ZSTD_createDCtx();
+        if (!zstd_c || !zstd_d) {
+            return -1;
+        }
+        ZSTD_CCtx_setParameter(zstd_c, ZSTD_c_compressionLevel,
+                               ZSTD_WIRE_LEVEL);
+        break;
+#endif
+#ifdef HAVE_LZ4
+    case COMM_COMPRESS_LZ4:
+        lz4_c = LZ4_createStream();
+        lz4_d = LZ4_createStreamDecode();
+        lz4_cring = (char *)malloc(LZ4_RING);
+        lz4_dring = (char *)malloc(LZ4_RING);
+        if (!lz4_c || !lz4_d || !lz4_cring || !lz4_dring) {
+            return -1;
+        }
+        lz4_cpos = lz4_dpos = 0;
+        break;
+#endif
+    default:
+        break;
+    }
+    comp_algo = algo;
+    return 0;
+}
+
+/* The most compress_pkt() makes of pktlen bytes: what it reserves,
+ * and what a receiver takes.
+ */
+static size_t comp_bound(size_t pktlen)
+{
+    switch (comp_algo) {
+#ifdef HAVE_ZSTD
+    case COMM_COMPRESS_ZSTD:
+        return ZSTD_compressBound(pktlen) + 64;
+#endif
+#ifdef HAVE_LZ4
+    case COMM_COMPRESS_LZ4:
+        return pktlen + pktlen / 128 + 64 + (pktlen / LZ4_PIECE + 1) * 4;
+#endif
+    default:
+        return pktlen;
+    }
+}
+
+/* Compress pkt into comp_buf, return the compressed length. */
+static size_t compress_pkt(void *pkt, size_t pktlen)
+{
+    size_t clen = 0;
+
+    switch (comp_algo) {
+#ifdef HAVE_ZSTD
+    case COMM_COMPRESS_ZSTD: {
+        ZSTD_inBuffer in = { pkt, pktlen, 0 };
+        ZSTD_outBuffer out;
+        size_t r;
+
+        comp_reserve(&comp_buf, &comp_cap, comp_bound(pktlen));
+        out.dst = comp_buf;
+        out.size = comp_cap;
+        out.pos = 0;
+        do {
+            r = ZSTD_compressStream2(zstd_c, &out, &in, ZSTD_e_flush);
+            if (ZSTD_isError(r)) {
+                fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(r));
+                exit(EXIT_FAILURE);
+            }
+        } while (r != 0);
+        clen = out.pos;
+        break;
+    }
+#endif
+#ifdef HAVE_LZ4
+    case COMM_COMPRESS_LZ4: {
+        size_t done = 0;
+
+        comp_reserve(&comp_buf, &comp_cap, comp_bound(pktlen));
+        do {
+            size_t n = pktlen - done < LZ4_PIECE ? pktlen - done : LZ4_PIECE;
+            uint32_t net_n;
+            int c;
+
+            if (lz4_cpos + n > LZ4_RING) {
+                lz4_cpos = 0;
+            }
+            memcpy(lz4_cring + lz4_cpos, (char *)pkt + done, n);
+            c = LZ4_compress_fast_continue(lz4_c, lz4_cring + lz4_cpos,
+                                           (char *)comp_buf + clen + 4,
+                                           (int)n, LZ4_compressBound((int)n),
+                                           1);
+            if (c <= 0) {
+                fprintf(stderr, "lz4: compression failed\n");
+                exit(EXIT_FAILURE);
+            }
+            net_n = htonl(c);
+            memcpy(comp_buf + clen, &net_n, 4);
+            clen += 4 + c;
+            lz4_cpos += n;
+            done += n;
+        } while (done < pktlen);
+        break;
+    }
+#endif
+    default:
+        abort();
+    }
+    return clen;
+}
+
+/* Decompress clen bytes of comp_buf into plain_buf. */
+static RisuResult decompress_pkt(size_t clen, size_t pktlen)
+{
+    comp_reserve(&plain_buf, &plain_cap, pktlen ? pktlen : 1);
+
+    switch (comp_algo) {
+#ifdef HAVE_ZSTD
+    case COMM_COMPRESS_ZSTD: {
+        ZSTD_inBuffer in = { comp_buf, clen, 0 };
+        ZSTD_outBuffer out = { plain_buf, pktlen, 0 };
+
+        while (in.pos < in.size) {
+            size_t in_pos = in.pos, out_pos = out.pos;
+            size_t r = ZSTD_decompressStream(zstd_d, &out, &in);
+            if (ZSTD_isError(r)
+                || (in.pos == in_pos && out.pos == out_pos)) {
+                /* Corrupt, or more data than the packet length says. */
+                return RES_BAD_IO;
+            }
+        }
+        return out.pos == pktlen ? RES_OK : RES_BAD_IO;
+    }
+#endif
+#ifdef HAVE_LZ4
+    case COMM_COMPRESS_LZ4: {
+        size_t done = 0, pos = 0;
+
+        do {
+            size_t n = pktlen - done < LZ4_PIECE ? pktlen - done : LZ4_PIECE;
+            uint32_t c;
+            int d;
+
+            if (pos + 4 > clen) {
+                return RES_BAD_IO;
+            }
+            memcpy(&c, comp_buf + pos, 4);
+            c = ntohl(c);
+            pos += 4;
+            if (c > clen - pos) {
+                return RES_BAD_IO;
+            }
+            if (lz4_dpos + n > LZ4_RING) {
+                lz4_dpos = 0;
+            }
+            d = LZ4_decompress_safe_continue(lz4_d, (char *)comp_buf + pos,
+                                             lz4_dring + lz4_dpos, (int)c,
+                                             (int)n);
+            if (d != (int)n) {
+                return RES_BAD_IO;
+            }
+            memcpy(plain_buf + done, lz4_dring + lz4_dpos, n);
+            lz4_dpos += n;
+            pos += c;
+            done += n;
+        } while (done < pktlen);
+        return pos == clen ? RES_OK : RES_BAD_IO;
+    }
+#endif
+    default:
+        abort();
+    }
+    return RES_BAD_IO;
+}
+#endif
+
+/* Transport wrappers: these look like read, writev and a
+ * non-blocking recv, whether we are on a socket or shared memory.
+ */
+static ssize_t comm_read(int sock, void *buf, size_t len)
+{
+#ifndef RISU_MACOS9
+    if (sock == shm_fd) {
+        return shm_read(buf, len, true);
+    }
+#endif
+    return read(sock, buf, len);
+}
+
+static ssize_t comm_write(int sock, const void *buf, size_t len)
+{
+#ifndef RISU_MACOS9
+    if (sock == shm_fd) {
+        return shm_write(buf, len);
+    }
+#endif
+    return write(sock, buf, len);
+}
+
+#ifndef RISU_MACOS9
+static ssize_t comm_writev(int sock, struct iovec *iov, int iovcnt)
+{
+    if (sock == shm_fd) {
+        ssize_t r = 0;
+        int i;
+        for (i = 0; i < iovcnt; i++) {
+            if (shm_write(iov[i].iov_base, iov[i].iov_len) == -1) {
+                return -1;
+            }
+            r += iov[i].iov_len;
+        }
+        return r;
+    }
+    return writev(sock, iov, iovcnt);
+}
+
+static ssize_t comm_read_nowait(int sock, void *buf, size_t len)
+{
+    if (sock == shm_fd) {
+        return shm_read(buf, len, false);
+    }
+    return recv(sock, buf, len, MSG_DONTWAIT);
+}
+#endif
+
 /* Utility functions which are just wrappers around read and writev
  * to catch errors and retry on short reads/writes.
  */
@@ -102,7 +741,7 @@ static void recv_bytes(int sock, void *pkt, int pktlen)
 {
     char *p = (char *)pkt;
     while (pktlen) {
-        int i = (int)read(sock, p, pktlen);
+        int i = (int)comm_read(sock, p, pktlen);
         if (i <= 0) {
             if (errno == EINTR) {
                 continue;
@@ -125,7 +764,7 @@ static void recv_and_discard_bytes(int sock, int pktlen)
         if (len > pktlen) {
             len = pktlen;
         }
-        i = (int)read(sock, dumpbuf, len);
+        i = (int)comm_read(sock, dumpbuf, len);
         if (i <= 0) {
             if (errno == EINTR) {
                 continue;
@@ -144,7 +783,7 @@ ssize_t safe_writev(int fd, struct iovec *iov_in, int iovcnt)
     int r = 0;
     struct iovec *iov = iov_in;
     for (;;) {
-        ssize_t i = writev(fd, iov, iovcnt);
+        ssize_t i = comm_writev(fd, iov, iovcnt);
         if (i == -1) {
             if (errno == EINTR) {
                 continue;
@@ -161,6 +800,7 @@ ssize_t safe_writev(int fd, struct iovec *iov_in, int iovcnt)
                 return r;
             }
         }
+        iov->iov_base = (char *)iov->iov_base + i;
         iov->iov_len -= i;
     }
 }
@@ -168,37 +808,162 @@ ssize_t safe_writev(int fd, struct iovec *iov_in, int iovcnt)
 /* Low level comms routines:
  * send_data_pkt sends a block of data and waits for
  * a single byte response code.
+ * send_data_pkt_nowait sends a block of data and only picks
+ * up a response code if one is already waiting.
+ * send_data_pkt_all sends the same block to several apprentices
+ * and collects their response codes (or only those already waiting).
  * recv_data_pkt receives a block of data.
  * send_response_byte sends the response code.
+ * recv_response_byte waits for the response code.
+ * recv_response_all waits for a response code from several apprentices.
  * Note that both ends must agree on the length of the
  * block of data.
  */
-RisuResult send_data_pkt(int sock, void *pkt, int pktlen)
+
+/* Fill in iov (3 entries) for a packet, return the number used.
+ * lens provides the storage for the length words.
+ */
+static int pkt_iov(struct iovec *iov, uint32_t *lens, void *pkt, int pktlen)
 {
-    unsigned char resp;
     /* First we send the packet length as a network-order 32 bit value.
      * This avoids silent deadlocks if the two sides disagree over
      * what size data packet they are transferring. We use writev()
      * so that both length and packet are sent in one packet; otherwise
      * we get 300x slowdown because we hit Nagle's algorithm.
      */
-    uint32_t net_pktlen = htonl(pktlen);
-    struct iovec iov[2];
-    iov[0].iov_base = &net_pktlen;
-    iov[0].iov_len = sizeof(net_pktlen);
+    lens[0] = htonl(pktlen);
+    iov[0].iov_base = &lens[0];
+    iov[0].iov_len = sizeof(lens[0]);
+
+    if (comp_algo != COMM_COMPRESS_NONE) {
+        size_t clen = compress_pkt(pkt, pktlen);
+        lens[1] = htonl((uint32_t)clen);
+        iov[1].iov_base = &lens[1];
+        iov[1].iov_len = sizeof(lens[1]);
+        iov[2].iov_base = comp_buf;
+        iov[2].iov_len = clen;
+        return 3;
+    }
+
     iov[1].iov_base = pkt;
     iov[1].iov_len = pktlen;
+    return 2;
+}
 
-    if (safe_writev(sock, iov, 2) == -1) {
+static ssize_t send_pkt(int sock, void *pkt, int pktlen)
+{
+    uint32_t lens[2];
+    struct iovec iov[3];
+    int iovcnt = pkt_iov(iov, lens, pkt, pktlen);
+
+    return safe_writev(sock, iov, iovcnt);
+}
+
+RisuResult send_data_pkt(int sock, void *pkt, int pktlen)
+{
+    if (send_pkt(sock, pkt, pktlen) == -1) {
         perror("writev failed");
         exit(EXIT_FAILURE);
     }
+    return recv_response_byte(sock);
+}
 
-    if (read(sock, &resp, 1) != 1) {
-        perror("read failed");
+RisuResult send_data_pkt_nowait(int sock, void *pkt, int pktlen)
+{
+    unsigned char resp;
+    ssize_t i;
+
+    if (send_pkt(sock, pkt, pktlen) == -1) {
+        if (errno == EPIPE || errno == ECONNRESET) {
+            /* The apprentice hung up on us, it should have said why. */
+            return recv_response_byte(sock);
+        }
+        perror("writev failed");
         exit(EXIT_FAILURE);
     }
-    return (RisuResult)resp;
+
+    /* The apprentice only responds when it wants us to stop. */
+    i = comm_read_nowait(sock, &resp, 1);
+    if (i == 1) {
+        return (RisuResult)resp;
+    }
+    if (i == 0) {
+        return RES_BAD_IO;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return RES_OK;
+    }
+    perror("recv failed");
+    exit(EXIT_FAILURE);
+}
+
+/* Read a response byte if there is one (or wait for it if block),
+ * without giving up on errors: a peer that has gone away reads as
+ * RES_BAD_IO. Returns -1 if nothing is waiting.
+ */
+static int poll_response_byte(int sock, bool block)
+{
+    unsigned char resp;
+    ssize_t i;
+
+    do {
+        i = block ? comm_read(sock, &resp, 1)
+                  : comm_read_nowait(sock, &resp, 1);
+    } while (i < 0 && errno == EINTR);
+    if (i == 1) {
+        return resp;
+    }
+    if (i < 0 && !block && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return -1;
+    }
+    return RES_BAD_IO;
+}
+
+void send_data_pkt_all(int *socks, RisuResult *res, int n,
+                       void *pkt, int pktlen, bool nowait)
+{
+    uint32_t lens[2];
+    struct iovec iov[3], tmp[3];
+    int iovcnt = pkt_iov(iov, lens, pkt, pktlen);
+    int i;
+
+    /* Send to everybody first, so the apprentices run in parallel. */
+    for (i = 0; i < n; i++) {
+        if (res[i] != RES_OK) {
+            continue;
+        }
+        memcpy(tmp, iov, sizeof(iov));
+        if (safe_writev(socks[i], tmp, iovcnt) == -1) {
+            if (errno != EPIPE && errno != ECONNRESET) {
+                perror("writev failed");
+                exit(EXIT_FAILURE);
+            }
+            /* It may have told us why it hung up. */
+            res[i] = (RisuResult)poll_response_byte(socks[i], true);
+            if (res[i] == RES_OK) {
+                res[i] = RES_BAD_IO;
+            }
+        }
+    }
+    for (i = 0; i < n; i++) {
+        if (res[i] == RES_OK) {
+            int r = poll_response_byte(socks[i], !nowait);
+            if (r >= 0) {
+                res[i] = (RisuResult)r;
+            }
+        }
+    }
+}
+
+void recv_response_all(int *socks, RisuResult *res, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (res[i] == RES_OK) {
+            res[i] = (RisuResult)poll_response_byte(socks[i], true);
+        }
+    }
 }
 
 RisuResult recv_data_pkt(int sock, void *pkt, int pktlen)
@@ -206,6 +971,30 @@ RisuResult recv_data_pkt(int sock, void *pkt, int pktlen)
     uint32_t net_pktlen;
     recv_bytes(sock, &net_pktlen, sizeof(net_pktlen));
     net_pktlen = ntohl(net_pktlen);
+    if (comp_algo != COMM_COMPRESS_NONE) {
+        uint32_t clen;
+        RisuResult res;
+
+        recv_bytes(sock, &clen, sizeof(clen));
+        clen = ntohl(clen);
+        /* Nothing is sized by the lengths before they are checked. */
+        if (clen > comp_bound(pktlen)) {
+            return RES_BAD_IO;
+        }
+        if (pktlen != net_pktlen) {
+            /* The decoder is out of step now, but this ends the run. */
+            recv_and_discard_bytes(sock, clen);
+            return RES_BAD_IO;
+        }
+        comp_reserve(&comp_buf, &comp_cap, clen ? clen : 1);
+        recv_bytes(sock, comp_buf, clen);
+        res = decompress_pkt(clen, pktlen);
+        if (res != RES_OK) {
+            return RES_BAD_IO;
+        }
+        memcpy(pkt, plain_buf, pktlen);
+        return RES_OK;
+    }
     if (pktlen != net_pktlen) {
         /* Mismatch. Read the data anyway so we can send
          * a response back.
@@ -221,8 +1010,23 @@ RisuResult recv_data_pkt(int sock, void *pkt, int pktlen)
 void send_response_byte(int sock, int resp)
 {
     unsigned char r = resp;
-    if (write(sock, &r, 1) != 1) {
+    if (comm_write(sock, &r, 1) != 1) {
         perror("write failed");
         exit(EXIT_FAILURE);
     }
 }
+
+RisuResult recv_response_byte(int sock)
+{
+    unsigned char resp;
+    ssize_t i;
+
+    do {
+        i = comm_read(sock, &resp, 1);
+    } while (i < 0 && errno == EINTR);
+    if (i != 1) {
+        perror("read failed");
+        exit(EXIT_FAILURE);
+    }
+    return (RisuResult)resp;
+}
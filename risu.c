@@ -15,18 +15,28 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <setjmp.h>
 #include <assert.h>
 #ifndef RISU_MACOS9
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
 #endif
 #include <fcntl.h>
 #include <string.h>
 
 #include "risu.h"
 #include "endianswap.h"
+#include "risu_hash.h"
+
+#ifdef RISU_HAVE_THREADS
+#include <pthread.h>
+#endif
 
 #ifdef NO_SIGNAL
     sig_handler_fn *sig_handler;
@@ -39,24 +49,75 @@ enum {
     MASTER = 0, APPRENTICE = 1
 };
 
-static struct reginfo ri[2];
-static uint8_t other_memblock[MEMBLOCKLEN];
-static trace_header_t header;
+static RISU_TLS struct reginfo ri[2];
+static RISU_TLS uint8_t other_memblock[MEMBLOCKLEN];
+static RISU_TLS trace_header_t header;
+
+/* What the apprentice compares against: ri[MASTER] and other_memblock,
+ * or the records themselves when playing back a trace held in memory.
+ */
+static RISU_TLS struct reginfo *master_ri;
+static RISU_TLS uint8_t *master_memblock;
+
+/* For checking that a struct reginfo in a trace can be used in place */
+struct reginfo_align {
+    char c;
+    struct reginfo ri;
+};
+#define REGINFO_ALIGN offsetof(struct reginfo_align, ri)
 
 /* Memblock pointer into the execution image. */
-static void *memblock;
-arch_ptr_t arch_memblock;
+static RISU_TLS void *memblock;
+RISU_TLS arch_ptr_t arch_memblock;
 
-static int comm_fd;
+static RISU_TLS int comm_fd;
 static bool trace;
-size_t signal_count;
-size_t illegal_instructions;
-static arch_ptr_t signal_pc;
-static bool is_setup;
-
-#ifdef HAVE_ZLIB
-#include <zlib.h>
-static gzFile gz_trace_file;
+static RISU_TLS int pipeline;
+static RISU_TLS int delta;
+static RISU_TLS int digest;
+static RISU_TLS int compress_algo;
+static int ismaster;
+
+/* Fan-out to several apprentices (master only) */
+#define MAX_APPRENTICES 64
+static int napprentices;
+static int apprentice_fds[MAX_APPRENTICES];
+static RisuResult verdicts[MAX_APPRENTICES];
+static size_t verdict_at[MAX_APPRENTICES];
+
+/* Apprentices started by the master itself */
+static const char *spawn_cmd;
+static int spawn_pids[MAX_APPRENTICES];
+static int nspawned;
+
+/* Recording the trace of a live run (master only) */
+static const char *tee_fn;
+static int tee_fd = -1;
+static int tee_pid;
+static RisuResult tee_res;
+static size_t tee_stop_at;
+static uint8_t tee_buf[65536];
+static size_t tee_len;
+
+/* Where recorded traces are kept for reuse (master only) */
+static const char *cache_dir;
+
+/* Master daemon */
+static int daemon_mode;
+static const char *image_dir;
+static RISU_TLS const char *image_name;
+RISU_TLS size_t signal_count;
+RISU_TLS size_t illegal_instructions;
+static RISU_TLS arch_ptr_t signal_pc;
+static RISU_TLS bool is_setup;
+
+static trace_file_t *trace_file;
+static trace_opts_t trace_opts;
+static int trace_sync;
+static trace_meta_t trace_meta;     /* the arch options given us */
+static bool header_pending;         /* read ahead by read_trace_meta() */
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD) || defined(HAVE_LZ4)
 #define TRACE_TYPE "compressed"
 #else
 #define TRACE_TYPE "uncompressed"
@@ -68,11 +129,11 @@ static gzFile gz_trace_file;
     #include <MachineExceptions.h>
     #include <Memory.h>
     #include <OSUtils.h>
-    static jmp_buf jmpbuf;
+    static RISU_TLS jmp_buf jmpbuf;
     ExceptionHandler prevHandler;
     OSStatus classic_exception_handler(ExceptionInformation *theException);
 #else
-    static sigjmp_buf jmpbuf;
+    static RISU_TLS sigjmp_buf jmpbuf;
 #endif
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
@@ -110,121 +171,988 @@ static void header_arch_to_host(trace_header_t *header) {
 
 /* I/O functions */
 
-static RisuResult read_buffer(void *ptr, size_t bytes)
+/* Convert between host and big endian (in either direction). */
+static uint32_t be32(uint32_t val)
 {
-    size_t res;
+#ifdef __LITTLE_ENDIAN__
+    return BYTESWAP_32(val);
+#else
+    return val;
+#endif
+}
 
+static RisuResult read_buffer(void *ptr, size_t bytes)
+{
 #ifndef RISU_MACOS9
     if (!trace) {
         return recv_data_pkt(comm_fd, ptr, (int)bytes);
     }
 #endif
 
-#ifdef HAVE_ZLIB
-    if (comm_fd == STDIN_FILENO) {
-#endif
-        res = read(comm_fd, ptr, bytes);
-#ifdef HAVE_ZLIB
-    } else {
-        res = gzread(gz_trace_file, ptr, bytes);
+    /* A trace ends with OP_TESTEND, running out of it is an error. */
+    return trace_read(trace_file, ptr, bytes) == RES_OK ? RES_OK : RES_BAD_IO;
+}
+
+/* Like read_buffer(), but with a trace that is already in memory, just
+ * point *pp at the data instead of copying it to buf.
+ */
+static RisuResult read_buffer_view(void **pp, void *buf, size_t bytes,
+                                   size_t align)
+{
+    void *p = trace ? trace_view(trace_file, bytes, align) : NULL;
+
+    if (p) {
+        *pp = p;
+        return RES_OK;
     }
-#endif
+    *pp = buf;
+    return read_buffer(buf, bytes);
+}
 
-    return res == bytes ? RES_OK : RES_BAD_IO;
+/* With several apprentices, each one that stops (for whatever reason)
+ * gets its verdict recorded, and the master carries on until they have
+ * all stopped.
+ */
+static RisuResult check_verdicts(void)
+{
+    bool running = false, all_io = true;
+    int i;
+
+    for (i = 0; i < napprentices; i++) {
+        if (verdicts[i] == RES_OK) {
+            running = true;
+            continue;
+        }
+        if (verdict_at[i] == (size_t)-1) {
+            verdict_at[i] = signal_count - illegal_instructions;
+        }
+        if (verdicts[i] != RES_BAD_IO) {
+            all_io = false;
+        }
+    }
+    if (running) {
+        return RES_OK;
+    }
+    return all_io ? RES_BAD_IO : RES_END;
 }
 
 static RisuResult write_buffer(void *ptr, size_t bytes)
 {
-    size_t res;
-
 #ifndef RISU_MACOS9
     if (!trace) {
+        if (napprentices > 1) {
+            send_data_pkt_all(apprentice_fds, verdicts, napprentices,
+                              ptr, (int)bytes, pipeline);
+            return check_verdicts();
+        }
+        if (pipeline) {
+            return send_data_pkt_nowait(comm_fd, ptr, (int)bytes);
+        }
         return send_data_pkt(comm_fd, ptr, (int)bytes);
     }
 #endif
 
-#ifdef HAVE_ZLIB
-    if (comm_fd == STDOUT_FILENO) {
+    return trace_write(trace_file, ptr, bytes);
+}
+
+/* Delta encoding of reginfo payloads.
+ *
+ * Consecutive reginfo payloads differ in only a handful of words, so
+ * with --delta the master sends just a bitmap of the 32-bit words that
+ * changed since the previous payload, followed by those words:
+ *
+ *   uint32_t size;                 full payload size in bytes
+ *   uint32_t map[DELTA_MAP_WORDS]; changed words
+ *   uint32_t words[];              one per bit set in map
+ *
+ * The size and map are big endian, the words are copied verbatim from
+ * the (arch byte order) payload.
+ */
+#define REGINFO_WORDS   ((sizeof(struct reginfo) + 3) / 4)
+#define DELTA_MAP_WORDS ((REGINFO_WORDS + 31) / 32)
+
+static RISU_TLS uint32_t delta_prev[REGINFO_WORDS];
+static RISU_TLS uint32_t delta_frame[1 + DELTA_MAP_WORDS + REGINFO_WORDS];
+
+/* Encode payload into delta_frame, return the frame size in bytes. */
+static size_t delta_encode(void *payload, size_t size)
+{
+    uint32_t cur[REGINFO_WORDS];
+    uint32_t *map = &delta_frame[1];
+    uint32_t *out = &delta_frame[1 + DELTA_MAP_WORDS];
+    size_t i, nwords = (size + 3) / 4;
+
+    memset(cur, 0, sizeof(cur));
+    memcpy(cur, payload, size);
+    memset(map, 0, DELTA_MAP_WORDS * 4);
+
+    for (i = 0; i < nwords; i++) {
+        if (cur[i] != delta_prev[i]) {
+            map[i / 32] |= 1u << (i % 32);
+            *out++ = cur[i];
+        }
+    }
+    for (i = 0; i < DELTA_MAP_WORDS; i++) {
+        map[i] = be32(map[i]);
+    }
+    delta_frame[0] = be32((uint32_t)size);
+    memcpy(delta_prev, cur, sizeof(cur));
+
+    return (out - delta_frame) * 4;
+}
+
+/* Rebuild the payload from the frame_size bytes in delta_frame. */
+static RisuResult delta_decode(void *payload, size_t frame_size,
+                               size_t *size)
+{
+    uint32_t *map = &delta_frame[1];
+    uint32_t *in = &delta_frame[1 + DELTA_MAP_WORDS];
+    uint32_t *end = (uint32_t *)((uint8_t *)delta_frame + frame_size);
+    size_t i, nwords;
+
+    if (frame_size < (1 + DELTA_MAP_WORDS) * 4 || frame_size % 4) {
+        return RES_BAD_SIZE_HEADER;
+    }
+    *size = be32(delta_frame[0]);
+    if (*size > sizeof(struct reginfo)) {
+        return RES_BAD_SIZE_HEADER;
+    }
+    nwords = (*size + 3) / 4;
+
+    for (i = 0; i < nwords; i++) {
+        if (be32(map[i / 32]) & (1u << (i % 32))) {
+            if (in == end) {
+                return RES_BAD_SIZE_HEADER;
+            }
+            delta_prev[i] = *in++;
+        }
+    }
+    if (in != end) {
+        return RES_BAD_SIZE_HEADER;
+    }
+    memcpy(payload, delta_prev, *size);
+    return RES_OK;
+}
+
+/* Digest comparison.
+ *
+ * With --digest the master sends a hash of the reginfo payload for
+ * each OP_COMPARE instead of the payload itself:
+ *
+ *   uint32_t size;   full payload size in bytes
+ *   uint64_t hash;   risu_hash64() of the (arch byte order) payload
+ *
+ * both big endian. If the apprentice's own payload hashes the same, the
+ * registers are identical. Otherwise it replies RES_RESEND and the master
+ * sends the full payload, which goes through the usual reginfo_is_eq()
+ * (a different hash may still be a match, e.g. for masked registers).
+ */
+#define DIGEST_LEN 12
+
+static RISU_TLS uint8_t digest_frame[DIGEST_LEN];
+
+static uint64_t reginfo_digest(struct reginfo *ri, size_t *size)
+{
+    struct reginfo tmp = *ri;
+
+    *size = reginfo_size(&tmp);
+    reginfo_host_to_arch(&tmp);
+    return risu_hash64(&tmp, *size, 0);
+}
+
+static void digest_encode(uint64_t hash, size_t size)
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        digest_frame[i] = (uint8_t)(size >> (24 - i * 8));
+    }
+    for (i = 0; i < 8; i++) {
+        digest_frame[4 + i] = (uint8_t)(hash >> (56 - i * 8));
+    }
+}
+
+static void digest_decode(uint64_t *hash, size_t *size)
+{
+    int i;
+
+    *size = 0;
+    for (i = 0; i < 4; i++) {
+        *size = (*size << 8) | digest_frame[i];
+    }
+    *hash = 0;
+    for (i = 0; i < 8; i++) {
+        *hash = (*hash << 8) | digest_frame[4 + i];
+    }
+}
+
+/* With --digest, OP_COMPAREMEM sends one hash per MEMBLOCK_CHUNK bytes
+ * of the memory block (big endian). The apprentice answers RES_RESEND
+ * followed by a bitmap of the chunks whose hashes differ from its own,
+ * and the master sends just those chunks.
+ */
+#define MEMBLOCK_CHUNK  256
+#define MEMBLOCK_CHUNKS (MEMBLOCKLEN / MEMBLOCK_CHUNK)
+#define MEMDIGEST_LEN   (MEMBLOCK_CHUNKS * 8)
+
+static RISU_TLS uint8_t memdigest_frame[MEMDIGEST_LEN];
+static RISU_TLS uint8_t memchunk_buf[MEMBLOCKLEN];
+
+static uint64_t memblock_chunk_hash(void *block, int i)
+{
+    return risu_hash64((uint8_t *)block + i * MEMBLOCK_CHUNK,
+                       MEMBLOCK_CHUNK, i);
+}
+
+static void memdigest_encode(void *block)
+{
+    int i, j;
+
+    for (i = 0; i < MEMBLOCK_CHUNKS; i++) {
+        uint64_t hash = memblock_chunk_hash(block, i);
+        for (j = 0; j < 8; j++) {
+            memdigest_frame[i * 8 + j] = (uint8_t)(hash >> (56 - j * 8));
+        }
+    }
+}
+
+static uint32_t memdigest_compare(void *block)
+{
+    uint32_t mask = 0;
+    int i, j;
+
+    for (i = 0; i < MEMBLOCK_CHUNKS; i++) {
+        uint64_t hash = 0;
+        for (j = 0; j < 8; j++) {
+            hash = (hash << 8) | memdigest_frame[i * 8 + j];
+        }
+        if (!block || hash != memblock_chunk_hash(block, i)) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+}
+
+/* Master side of RES_RESEND for OP_COMPAREMEM. */
+static RisuResult send_memblock_chunks(void)
+{
+#ifndef RISU_MACOS9
+    uint32_t mask;
+    size_t len = 0;
+    int i;
+
+    if (recv_data_pkt(comm_fd, &mask, sizeof(mask)) != RES_OK) {
+        return RES_BAD_IO;
+    }
+    send_response_byte(comm_fd, RES_OK);
+    mask = be32(mask);
+
+    for (i = 0; i < MEMBLOCK_CHUNKS; i++) {
+        if (mask & (1u << i)) {
+            memcpy(memchunk_buf + len,
+                   (uint8_t *)memblock + i * MEMBLOCK_CHUNK, MEMBLOCK_CHUNK);
+            len += MEMBLOCK_CHUNK;
+        }
+    }
+    return write_buffer(memchunk_buf, len);
+#else
+    return RES_BAD_IO;
 #endif
-        res = write(comm_fd, ptr, bytes);
-#ifdef HAVE_ZLIB
-    } else {
-        res = gzwrite(gz_trace_file, ptr, bytes);
+}
+
+/* Sampled comparison.
+ *
+ * With --sample N only every Nth OP_COMPARE goes over the connection.
+ * Both ends fold the registers at the others into a running hash, and
+ * before each one that does go (and before OP_TESTEND) the master sends
+ * an OP_SAMPLE record with the number of checkpoints folded since the
+ * last and their hash, laid out like a digest frame. If the apprentice's
+ * differ, or anything else goes wrong while some are folded, it answers
+ * RES_RERUN: both ends start the image again, pass the checkpoints known
+ * to match without a word, and compare every one after them in full, so
+ * that a mismatch is reported where it first happened.
+ */
+enum {
+    SAMPLE_FULL,    /* sent and compared as usual */
+    SAMPLE_CHECK,   /* OP_SAMPLE first, then as usual */
+    SAMPLE_FOLD,    /* only folded into the hash */
+    SAMPLE_SKIP,    /* known to match, when running again */
+};
+
+static RISU_TLS int sample_n;           /* --sample N, 0 to compare every one */
+static RISU_TLS bool sample_rerun;      /* running again after RES_RERUN */
+static RISU_TLS size_t sample_count;    /* OP_COMPAREs so far */
+static RISU_TLS size_t sample_good;     /* of them, known to match */
+static RISU_TLS size_t sample_folded;   /* OP_COMPAREs in sample_hash */
+static RISU_TLS uint64_t sample_hash;
+
+/* Which of the above to do with a checkpoint for op. */
+static int sample_checkpoint(RisuOp op)
+{
+    if (!sample_n) {
+        return SAMPLE_FULL;
+    }
+    if (op == OP_COMPARE) {
+        sample_count++;
+    }
+    if (sample_rerun) {
+        if (sample_count < sample_good
+            || (sample_count == sample_good && op == OP_COMPARE)) {
+            return SAMPLE_SKIP;
+        }
+        return SAMPLE_FULL;
+    }
+    if (op == OP_TESTEND || (op == OP_COMPARE && sample_count % sample_n == 0)) {
+        return SAMPLE_CHECK;
+    }
+    /* Registers don't have to match during setup. */
+    return op == OP_COMPARE && !is_setup ? SAMPLE_FOLD : SAMPLE_FULL;
+}
+
+static void sample_fold(struct reginfo *ri)
+{
+    struct reginfo tmp = *ri;
+
+    reginfo_host_to_arch(&tmp);
+    sample_hash = risu_hash64(&tmp, reginfo_size(ri), sample_hash);
+    sample_folded++;
+}
+
+/* The checkpoints folded before op's have been found to match. */
+static void sample_checked(RisuOp op)
+{
+    sample_good = sample_count - (op == OP_COMPARE);
+    sample_folded = 0;
+    sample_hash = 0;
+}
+
+/* What a checkpoint that isn't sent still has to do. */
+static void sample_skip(RisuOp op, struct reginfo *ri, void *uc)
+{
+    switch (op) {
+    case OP_SETMEMBLOCK:
+        arch_memblock = get_reginfo_paramreg(ri);
+        memblock = get_arch_memory(arch_memblock);
+        break;
+    case OP_GETMEMBLOCK:
+        set_ucontext_paramreg(uc, get_reginfo_paramreg(ri) + arch_memblock);
+        break;
+    case OP_SETUPBEGIN:
+    case OP_SETUPEND:
+        is_setup = op == OP_SETUPBEGIN;
+        break;
+    default:
+        break;
     }
+}
+
+/* Spilled checkpoints.
+ *
+ * An image generated with risugen --spill doesn't trap at each compare:
+ * it stores its registers to the next slot of a ring in memory, and
+ * traps with OP_COMPARESPILL when the ring is full or before any other
+ * risu op. The param register then points at the ring, which is a
+ * 32-bit slot count and the size of the GPRs in the slots (both in arch
+ * byte order), then that many struct spillinfo, whose layout the
+ * architecture defines. Each slot is
+ * handled exactly like the OP_COMPARE it stands for, so records, traces,
+ * --digest and --sample can't tell the difference.
+ */
+static RISU_TLS arch_ptr_t spill_pc;    /* of the spilled slot being handled */
+static RISU_TLS bool spill_matched;     /* it matched, reginfo_update() due */
+
+/* Where the checkpoint being handled was taken. */
+static arch_ptr_t checkpoint_pc(void *uc, void *siaddr)
+{
+    return spill_pc ? spill_pc : get_uc_pc(uc, siaddr);
+}
+
+#ifdef RISU_HAVE_SPILL
+static struct spillinfo *spill_ring(struct reginfo *ri, uint32_t *count)
+{
+    uint8_t *ring = (uint8_t *)get_arch_memory(get_reginfo_paramreg(ri));
+    uint32_t n, width;
+
+    memcpy(&n, ring, sizeof(n));
+    memcpy(&width, ring + 4, sizeof(width));
+    width = arch_to_host_32(width);
+    if (width != RISU_SPILL_WIDTH) {
+        /* Narrower slots would leave half of each register behind. */
+        fprintf(stderr, "Error: the image spills %u-byte registers, "
+                "they are %u bytes here (see risugen --spill64)\n",
+                width, (unsigned)RISU_SPILL_WIDTH);
+        return NULL;
+    }
+    *count = arch_to_host_32(n);
+    return (struct spillinfo *)(ring + 8);
+}
 #endif
 
-    return res == bytes ? RES_OK : RES_BAD_IO;
+/* Trace metadata.
+ *
+ * A trace we record starts with an OP_METADATA record saying which
+ * image it is of and how it was recorded, so that playing it back with
+ * another image fails straight away rather than at the first
+ * mismatch, and the options it needs don't have to be given again.
+ */
+static void fill_trace_meta(trace_meta_t *m, uint32_t options)
+{
+    uint64_t hash = risu_hash64((void *)image_start, image_size, 0);
+
+    *m = trace_meta;
+    m->version = TRACE_META_VERSION;
+    m->big_endian = get_arch_big_endian();
+    m->reginfo_size = sizeof(struct reginfo);
+    m->memblock_len = MEMBLOCKLEN;
+    m->options = options;
+    m->image_hash[0] = (uint32_t)(hash >> 32);
+    m->image_hash[1] = (uint32_t)hash;
+    memset(m->image_name, 0, TRACE_META_NAME_LEN);
+    if (image_name) {
+        strncpy(m->image_name, image_name, TRACE_META_NAME_LEN - 1);
+    }
+}
+
+static RisuResult write_trace_meta(trace_file_t *t, uint32_t options)
+{
+    trace_meta_t m;
+    trace_header_t h;
+    RisuResult res;
+
+    fill_trace_meta(&m, options);
+    trace_meta_swap(&m);
+
+    h.magic = RISU_MAGIC;
+    h.size = sizeof(m);
+    h.risu_op = OP_METADATA;
+    h.pc = 0;
+    header_host_to_arch(&h);
+    res = trace_write(t, &h, sizeof(h));
+    return res == RES_OK ? trace_write(t, &m, sizeof(m)) : res;
+}
+
+/* Check the metadata a trace being played back starts with (if it does)
+ * and take its options. Otherwise its first header is left for
+ * recv_register_info().
+ */
+static void read_trace_meta(void)
+{
+    trace_meta_t m;
+    uint64_t hash, theirs;
+
+    if (read_buffer(&header, sizeof(header)) != RES_OK) {
+        /* The apprentice reports the empty trace. */
+        return;
+    }
+    header_arch_to_host(&header);
+    if (header.magic != RISU_MAGIC || header.risu_op != OP_METADATA) {
+        header_pending = true;
+        return;
+    }
+    if (header.size != sizeof(m) || read_buffer(&m, sizeof(m)) != RES_OK) {
+        fprintf(stderr, "Error: the trace has bad metadata\n");
+        exit(EXIT_FAILURE);
+    }
+    trace_meta_swap(&m);
+    if (!trace_meta_check(&m)) {
+        exit(EXIT_FAILURE);
+    }
+
+    hash = risu_hash64((void *)image_start, image_size, 0);
+    theirs = ((uint64_t)m.image_hash[0] << 32) | m.image_hash[1];
+    if (hash != theirs) {
+        fprintf(stderr, "Error: the trace was recorded from image %s, "
+                "not %s\n", m.image_name, image_name);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!delta != !(m.options & TRACE_META_DELTA)) {
+        fprintf(stderr, "using the trace's --delta setting\n");
+    }
+    delta = (m.options & TRACE_META_DELTA) != 0;
+    if (!trace_meta.arch_opts[0] && m.arch_opts[0]) {
+        fprintf(stderr, "using the trace's options %s\n", m.arch_opts);
+        if (!trace_meta_apply_arch_opts(&m)) {
+            exit(EXIT_FAILURE);
+        }
+    } else if (strcmp(trace_meta.arch_opts, m.arch_opts) != 0) {
+        fprintf(stderr, "warning: the trace was recorded with options "
+                "\"%s\"\n", m.arch_opts);
+    }
+}
+
+/* Tee mode.
+ *
+ * With --tee the master also records the trace of its live run. The
+ * signal handler only copies each record into tee_buf; full buffers go
+ * down a pipe to a writer process, which compresses them and writes the
+ * file, so that cost is not added to every checkpoint. The trace always
+ * holds full register dumps and memory blocks, whatever --delta or
+ * --digest put on the wire, so it can be played back with a plain -t.
+ */
+static void tee_flush(void)
+{
+    size_t done = 0;
+
+    while (done < tee_len) {
+        long n = write(tee_fd, tee_buf + done, tee_len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            /* Losing the trace shouldn't cost us the live verdict. */
+            fprintf(stderr, "tee: trace writer went away, not recording "
+                    "any more\n");
+            close(tee_fd);
+            tee_fd = -1;
+            break;
+        }
+        done += n;
+    }
+    tee_len = 0;
+}
+
+/* Each record goes down the pipe behind its image offset, length and
+ * whether it is in setup code (host order), which the writer needs for
+ * the trace index.
+ */
+static void tee_record(RisuOp op, arch_ptr_t pc, uint32_t image_offset,
+                       void *payload, size_t size)
+{
+    uint32_t prefix[3];
+    trace_header_t h;
+
+    h.magic = RISU_MAGIC;
+    h.size = (uint32_t)size;
+    h.risu_op = op;
+    h.pc = pc;
+    header_host_to_arch(&h);
+    prefix[0] = image_offset;
+    prefix[1] = (uint32_t)(sizeof(h) + size);
+    prefix[2] = is_setup;
+
+    if (tee_len + sizeof(prefix) + sizeof(h) + size > sizeof(tee_buf)) {
+        tee_flush();
+    }
+    memcpy(tee_buf + tee_len, prefix, sizeof(prefix));
+    tee_len += sizeof(prefix);
+    memcpy(tee_buf + tee_len, &h, sizeof(h));
+    tee_len += sizeof(h);
+    if (size) {
+        memcpy(tee_buf + tee_len, payload, size);
+        tee_len += size;
+    }
+}
+
+/* The live side of a tee has stopped with res. Return true if we carry
+ * on to finish the trace, which we do unless we aren't recording.
+ */
+static bool tee_stop(RisuResult res, void *uc, void *siaddr)
+{
+    if (tee_fd < 0) {
+        return false;
+    }
+    tee_res = res;
+    tee_stop_at = signal_count - illegal_instructions;
+    signal_pc = checkpoint_pc(uc, siaddr);
+    return true;
+}
+
+#ifndef RISU_MACOS9
+/* Read len bytes of the pipe from tee_record(). RES_END if it ends
+ * before them, RES_BAD_IO if it ends part way.
+ */
+static RisuResult tee_read(int in, void *ptr, size_t len)
+{
+    uint8_t *p = (uint8_t *)ptr;
+    size_t done = 0;
+
+    while (done < len) {
+        long n = read(in, p + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return done || n < 0 ? RES_BAD_IO : RES_END;
+        }
+        done += n;
+    }
+    return RES_OK;
+}
+
+/* The writer process: split the stream from tee_record() into records
+ * again, so that an indexed trace gets its frames cut and indexed.
+ * The pipe is ours, so it is read as it is and not as a trace.
+ */
+static void tee_writer(int in, int out)
+{
+    static uint8_t buf[sizeof(tee_buf)];
+    trace_file_t *wt = trace_open_write(out, &trace_opts);
+    uint32_t prefix[3];
+    RisuResult res = RES_BAD_IO;
+
+    /* Full records, whatever --delta is. */
+    if (!wt || write_trace_meta(wt, 0) != RES_OK) {
+        _exit(EXIT_FAILURE);
+    }
+    while ((res = tee_read(in, prefix, sizeof(prefix))) == RES_OK) {
+        if (prefix[1] > sizeof(buf)
+            || tee_read(in, buf, prefix[1]) != RES_OK
+            || trace_mark(wt, prefix[0], prefix[2]) != RES_OK
+            || trace_write(wt, buf, prefix[1]) != RES_OK) {
+            res = RES_BAD_IO;
+            break;
+        }
+    }
+    if (res != RES_END || trace_close(wt) != RES_OK) {
+        fprintf(stderr, "tee: failed to write %s\n", tee_fn);
+        _exit(EXIT_FAILURE);
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+/* Start the writer process for --tee. */
+static void tee_open(void)
+{
+    int fd, p[2];
+
+    fd = open(tee_fn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "trace file \"%s\" cannot be opened\n", tee_fn);
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+    if (trace_opts.format < 0) {
+        trace_opts.format = TRACE_FORMAT_INDEXED;
+    }
+    if (pipe(p) != 0) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    tee_pid = fork();
+    if (tee_pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (tee_pid == 0) {
+        close(p[1]);
+        tee_writer(p[0], fd);
+    }
+    close(p[0]);
+    close(fd);
+    /* Apprentices we spawn mustn't keep the writer from seeing EOF. */
+    fcntl(p[1], F_SETFD, FD_CLOEXEC);
+    tee_fd = p[1];
+    tee_len = 0;
+    /* We find out about a dead writer from write() instead. */
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "master: recording trace to %s\n", tee_fn);
+}
+
+/* Flush the trace and wait for the writer, returns false if it failed. */
+static bool tee_close(void)
+{
+    bool ok = tee_fd >= 0;
+    int status;
+
+    if (tee_fd >= 0) {
+        tee_flush();
+    }
+    if (tee_fd >= 0) {
+        close(tee_fd);
+        tee_fd = -1;
+    }
+    if (waitpid(tee_pid, &status, 0) < 0) {
+        perror("waitpid");
+        return false;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "tee: trace writer failed, %s is incomplete\n",
+                tee_fn);
+        return false;
+    }
+    return ok;
+}
+
+/* Trace cache.
+ *
+ * With --trace-cache a master recording a trace first looks in the
+ * cache directory for one recorded before from the same image by the
+ * same build of risu with the same options, and only runs the image
+ * when there is none; a complete new trace is then added. Entries are
+ * named by a hash of the trace metadata without the image name and of
+ * how the trace is encoded, so they are found whatever the image file
+ * is called, but a run never gets a trace in another format or codec
+ * than it asked for. Traces are copied
+ * in and out rather than linked, so that recording over a trace file
+ * later can't change the cached one.
+ */
+static char cache_fn[PATH_MAX];
+
+static void cache_path(char *path, size_t len)
+{
+    /* The reginfo header names the architecture risu was built for. */
+    static const char arch_build[] = REGINFO_HEADER(ARCH);
+    trace_meta_t m;
+    uint32_t enc[4];
+    uint64_t key;
+
+    /* Only -t traces are --delta coded, --tee ones never are. */
+    fill_trace_meta(&m, trace && delta ? TRACE_META_DELTA : 0);
+    memset(m.image_name, 0, TRACE_META_NAME_LEN);
+    trace_meta_swap(&m);
+    key = risu_hash64(arch_build, sizeof(arch_build), 0);
+    key = risu_hash64(&m, sizeof(m), key);
+    /* With the defaults a file trace gets, it isn't opened yet. */
+    enc[0] = be32(trace_opts.format < 0 ? TRACE_FORMAT_INDEXED
+                                        : trace_opts.format);
+    enc[1] = be32(trace_opts.codec < 0 ? trace_codec_default()
+                                       : trace_opts.codec);
+    enc[2] = be32(trace_opts.level);
+    enc[3] = be32(trace_opts.layout);
+    key = risu_hash64(enc, sizeof(enc), key);
+    snprintf(path, len, "%s/%016" PRIx64 ".trace", cache_dir, key);
+}
+
+/* Copy a file through a temporary one, so that nobody sees half of it. */
+static bool copy_file(const char *from, const char *to)
+{
+    char tmp[PATH_MAX], buf[65536];
+    int in, out;
+    long n = -1;
+    bool ok;
+
+    in = open(from, O_RDONLY);
+    if (in < 0) {
+        return false;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", to, (int)getpid());
+    out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    ok = out >= 0;
+    while (ok && (n = read(in, buf, sizeof(buf))) > 0) {
+        long done = 0;
+
+        while (ok && done < n) {
+            long w = write(out, buf + done, n - done);
+
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+            ok = w > 0;
+            done += w;
+        }
+    }
+    close(in);
+    if (out >= 0) {
+        ok = close(out) == 0 && ok && n == 0 && rename(tmp, to) == 0;
+        if (!ok) {
+            unlink(tmp);
+        }
+    }
+    return ok;
+}
+
+/* Give fn the cached trace of this run, returns false if there is none.
+ * This is before the image runs, which changes its memory block and so
+ * its hash.
+ */
+static bool cache_fetch(const char *fn)
+{
+    char *path = cache_fn;
+
+    cache_path(path, sizeof(cache_fn));
+    if (access(path, R_OK) != 0) {
+        return false;
+    }
+    if (!copy_file(path, fn)) {
+        fprintf(stderr, "trace cache: %s cannot be copied to %s\n",
+                path, fn);
+        perror("copy");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "master: trace of %s taken from the cache (%s)\n",
+            image_name, path);
+    return true;
+}
+
+/* Add the trace in fn, just recorded, to the cache. */
+static void cache_store(const char *fn)
+{
+    const char *path = cache_fn;
+
+    if (mkdir(cache_dir, 0777) != 0 && errno != EEXIST) {
+        perror("mkdir");
+    } else if (copy_file(fn, path)) {
+        fprintf(stderr, "master: trace added to the cache as %s\n", path);
+        return;
+    }
+    /* The trace is still there to use, just not cached. */
+    fprintf(stderr, "trace cache: %s cannot be added as %s\n", fn, path);
 }
+#endif
 
 static void respond(RisuResult r)
 {
-    if (!trace) {
+    /* When pipelining, the master only wants to hear about the end. */
+    if (!trace && !(pipeline && r == RES_OK)) {
         send_response_byte(comm_fd, r);
     }
 }
 
-static RisuResult send_register_info(void *uc, void *siaddr)
+/* Send the hash of the checkpoints folded before op's. */
+static RisuResult send_sample(RisuOp op)
 {
-    arch_ptr_t paramreg;
+    trace_header_t h;
     RisuResult res;
-    RisuOp op;
-    void *extra;
 
-    reginfo_init(&ri[MASTER], uc, siaddr);
-    op = get_risuop(&ri[MASTER]);
-    if (op == OP_SIGILL) {
-        illegal_instructions++;
-        if (is_setup)
-            return RES_OK;
+    h.magic = RISU_MAGIC;
+    h.pc = header.pc;
+    h.risu_op = OP_SAMPLE;
+    h.size = DIGEST_LEN;
+    header_host_to_arch(&h);
+    digest_encode(sample_hash, sample_folded);
+
+    res = write_buffer(&h, sizeof(h));
+    if (res == RES_OK) {
+        res = write_buffer(digest_frame, DIGEST_LEN);
     }
+    if (res == RES_OK) {
+        sample_checked(op);
+    }
+    return res;
+}
+
+/* Send the checkpoint for op, whose registers are in ri[MASTER]. */
+static RisuResult send_checkpoint(RisuOp op, void *uc, void *siaddr)
+{
+    arch_ptr_t paramreg;
+    RisuResult res;
+    void *extra, *tee_extra = NULL;
+    size_t size, full_size = 0, tee_size = 0;
+    uint32_t image_offset;
 
     /* Write a header with PC/op to keep in sync */
     header.magic = RISU_MAGIC;
     header.pc = get_pc(&ri[MASTER]);
     header.risu_op = op;
 
+    switch (sample_checkpoint(op)) {
+    case SAMPLE_FOLD:
+        sample_fold(&ri[MASTER]);
+        /* fall through */
+    case SAMPLE_SKIP:
+        sample_skip(op, &ri[MASTER], uc);
+        return RES_OK;
+    case SAMPLE_CHECK:
+        res = send_sample(op);
+        if (res != RES_OK) {
+            return res;
+        }
+        break;
+    }
+
     switch (op) {
     case OP_TESTEND:
     case OP_COMPARE:
     case OP_SIGILL:
-        header.size = reginfo_size(&ri[MASTER]);
+        if (digest && op == OP_COMPARE) {
+            uint64_t hash = reginfo_digest(&ri[MASTER], &full_size);
+            digest_encode(hash, full_size);
+            reginfo_host_to_arch(&ri[MASTER]);
+            size = DIGEST_LEN;
+            extra = digest_frame;
+            tee_size = full_size;
+            tee_extra = &ri[MASTER];
+            break;
+        }
+        size = reginfo_size(&ri[MASTER]);
         extra = &ri[MASTER];
         reginfo_host_to_arch(&ri[MASTER]);
+        tee_size = size;
+        tee_extra = extra;
+        if (delta) {
+            size = delta_encode(extra, size);
+            extra = delta_frame;
+        }
         break;
     case OP_COMPAREMEM:
-        header.size = MEMBLOCKLEN;
+        if (digest) {
+            memdigest_encode(memblock);
+            size = MEMDIGEST_LEN;
+            extra = memdigest_frame;
+            tee_size = MEMBLOCKLEN;
+            tee_extra = memblock;
+            break;
+        }
+        size = MEMBLOCKLEN;
         extra = memblock;
+        tee_size = size;
+        tee_extra = extra;
         break;
     case OP_SETMEMBLOCK:
     case OP_GETMEMBLOCK:
     case OP_SETUPBEGIN:
     case OP_SETUPEND:
-        header.size = 0;
+        size = 0;
         extra = NULL;
         break;
     default:
         abort();
     }
 
-    header_host_to_arch(&header);
-    res = write_buffer(&header, sizeof(header));
-    if (res != RES_OK) {
-        return res;
+    /* The trace index wants to know where each record comes from. */
+    image_offset = checkpoint_pc(uc, siaddr) - get_arch_start_address();
+    if (tee_fd >= 0) {
+        tee_record(op, header.pc, image_offset, tee_extra, tee_size);
     }
-    if (extra) {
-        res = write_buffer(extra, header.size);
+    if (trace) {
+        res = trace_mark(trace_file, image_offset, is_setup);
         if (res != RES_OK) {
             return res;
         }
     }
 
+    header.size = (uint32_t)size;
+    header_host_to_arch(&header);
+    /* Once a tee's apprentice has stopped we are only recording. */
+    if (tee_res == RES_OK) {
+        res = write_buffer(&header, sizeof(header));
+        if (res == RES_OK && extra) {
+            res = write_buffer(extra, size);
+            if (res == RES_RESEND && extra == digest_frame) {
+                /* The apprentice wants to see the registers. */
+                res = write_buffer(&ri[MASTER], full_size);
+            } else if (res == RES_RESEND && extra == memdigest_frame) {
+                res = send_memblock_chunks();
+            }
+        }
+        if (res != RES_OK && !tee_stop(res, uc, siaddr)) {
+            return res;
+        }
+    }
+
     switch (op) {
     case OP_COMPARE:
     case OP_SIGILL:
     case OP_COMPAREMEM:
         break;
     case OP_TESTEND:
-        return RES_END;
+#ifndef RISU_MACOS9
+        if (pipeline && !trace && tee_res == RES_OK) {
+            /* Don't hang up before the apprentice has caught up. */
+            if (napprentices > 1) {
+                recv_response_all(apprentice_fds, verdicts, napprentices);
+                check_verdicts();
+            } else {
+                /* Its verdict on what it has caught up with. */
+                res = recv_response_byte(comm_fd);
+                if (res != RES_OK && res != RES_END) {
+                    return res;
+                }
+            }
+        }
+#endif
+        return tee_res != RES_OK ? tee_res : RES_END;
     case OP_SETMEMBLOCK:
         arch_memblock = get_reginfo_paramreg(&ri[MASTER]);
         memblock = get_arch_memory(arch_memblock);
@@ -243,6 +1171,50 @@ static RisuResult send_register_info(void *uc, void *siaddr)
     return RES_OK;
 }
 
+#ifdef RISU_HAVE_SPILL
+static RisuResult send_spilled(void *uc, void *siaddr)
+{
+    struct spillinfo *slot;
+    RisuResult res = RES_OK;
+    uint32_t i, count;
+
+    slot = spill_ring(&ri[MASTER], &count);
+    if (!slot) {
+        return RES_BAD_IO;
+    }
+    /* The trap isn't a checkpoint, each slot is. */
+    signal_count--;
+    for (i = 0; i < count && res == RES_OK; i++) {
+        signal_count++;
+        spill_pc = reginfo_init_spill(&ri[MASTER], &slot[i]);
+        res = send_checkpoint(OP_COMPARE, uc, siaddr);
+    }
+    if (res == RES_OK) {
+        spill_pc = 0;
+    }
+    return res;
+}
+#endif
+
+static RisuResult send_register_info(void *uc, void *siaddr)
+{
+    RisuOp op;
+
+    reginfo_init(&ri[MASTER], uc, siaddr);
+    op = get_risuop(&ri[MASTER]);
+    if (op == OP_SIGILL) {
+        illegal_instructions++;
+        if (is_setup)
+            return RES_OK;
+    }
+#ifdef RISU_HAVE_SPILL
+    if (op == OP_COMPARESPILL) {
+        return send_spilled(uc, siaddr);
+    }
+#endif
+    return send_checkpoint(op, uc, siaddr);
+}
+
 static void master_sigill(int sig, arch_siginfo_t *si, void *uc)
 {
     RisuResult r;
@@ -251,30 +1223,137 @@ static void master_sigill(int sig, arch_siginfo_t *si, void *uc)
     if (sig == SIGBUS) {
         r = RES_SIGBUS;
     }
-    else {
-        r = send_register_info(uc, si->si_addr);
+    else {
+        r = send_register_info(uc, si->si_addr);
+    }
+    if (r == RES_OK) {
+        advance_pc(uc);
+    } else {
+        if (r != tee_res) {
+            /* Otherwise tee_stop() has noted where the apprentice was. */
+            signal_pc = checkpoint_pc(uc, si->si_addr);
+        }
+#ifdef RISU_MACOS9
+        longjmp(jmpbuf, r);
+#else
+        siglongjmp(jmpbuf, r);
+#endif
+    }
+}
+
+/* Receive a digest frame, and the full payload if it doesn't match ours. */
+static RisuResult recv_digest(struct reginfo *mri)
+{
+    RisuResult res;
+    uint64_t hash;
+    size_t size, app_size;
+
+    if (header.size != DIGEST_LEN) {
+        return RES_BAD_SIZE_HEADER;
+    }
+    respond(RES_OK);
+    res = read_buffer(digest_frame, DIGEST_LEN);
+    if (res != RES_OK) {
+        return res;
+    }
+    digest_decode(&hash, &size);
+    if (size > sizeof(*mri)) {
+        return RES_BAD_SIZE_HEADER;
+    }
+
+    if (hash == reginfo_digest(&ri[APPRENTICE], &app_size)
+        && size == app_size) {
+        *mri = ri[APPRENTICE];
+        return RES_OK;
+    }
+
+    respond(RES_RESEND);
+    res = read_buffer(mri, size);
+    reginfo_arch_to_host(mri);
+    if (res == RES_OK && size != reginfo_size(mri)) {
+        return RES_BAD_SIZE_REGINFO;
+    }
+    return res;
+}
+
+/* Receive chunk hashes for the memory block, then the chunks that
+ * differ from ours. Leaves the master's view of the block in
+ * other_memblock.
+ */
+static RisuResult recv_memdigest(void)
+{
+#ifndef RISU_MACOS9
+    RisuResult res;
+    uint32_t mask, net_mask;
+    size_t len = 0;
+    int i;
+
+    if (header.size != MEMDIGEST_LEN) {
+        return RES_BAD_SIZE_MEMBLOCK;
+    }
+    master_memblock = other_memblock;
+    respond(RES_OK);
+    res = read_buffer(memdigest_frame, MEMDIGEST_LEN);
+    if (res != RES_OK) {
+        return res;
+    }
+
+    mask = memdigest_compare(memblock);
+    if (memblock) {
+        memcpy(other_memblock, memblock, MEMBLOCKLEN);
+    }
+    if (mask == 0) {
+        return RES_OK;
+    }
+
+    respond(RES_RESEND);
+    net_mask = be32(mask);
+    res = send_data_pkt(comm_fd, &net_mask, sizeof(net_mask));
+    if (res != RES_OK) {
+        return res;
+    }
+    for (i = 0; i < MEMBLOCK_CHUNKS; i++) {
+        if (mask & (1u << i)) {
+            len += MEMBLOCK_CHUNK;
+        }
+    }
+    res = read_buffer(memchunk_buf, len);
+    if (res != RES_OK) {
+        return res;
+    }
+    len = 0;
+    for (i = 0; i < MEMBLOCK_CHUNKS; i++) {
+        if (mask & (1u << i)) {
+            memcpy(other_memblock + i * MEMBLOCK_CHUNK, memchunk_buf + len,
+                   MEMBLOCK_CHUNK);
+            len += MEMBLOCK_CHUNK;
+        }
     }
-    if (r == RES_OK) {
-        advance_pc(uc);
-    } else {
-        signal_pc = get_uc_pc(uc, si->si_addr);
-#ifdef RISU_MACOS9
-        longjmp(jmpbuf, r);
+    return RES_OK;
 #else
-        siglongjmp(jmpbuf, r);
+    return RES_BAD_IO;
 #endif
-    }
 }
 
-static RisuResult recv_register_info(struct reginfo *ri)
+/* Receive the master's next record. *pri is where register info is to
+ * go, and is updated if it is used where it is instead.
+ */
+static RisuResult recv_register_info(struct reginfo **pri)
 {
+    struct reginfo *ri = *pri;
     RisuResult res;
+    size_t size;
+    void *p;
 
-    res = read_buffer(&header, sizeof(header));
-    if (res != RES_OK) {
-        return res;
+    if (header_pending) {
+        header_pending = false;
+    } else {
+        res = read_buffer(&header, sizeof(header));
+        if (res != RES_OK) {
+            return res;
+        }
+        header_arch_to_host(&header);
     }
-    header_arch_to_host(&header);
 
     if (header.magic != RISU_MAGIC) {
         /* If the magic number is wrong, we can't trust the rest. */
@@ -285,25 +1364,56 @@ static RisuResult recv_register_info(struct reginfo *ri)
     case OP_COMPARE:
     case OP_TESTEND:
     case OP_SIGILL:
-        /* If we can't store the data, report invalid size. */
-        if (header.size > sizeof(*ri)) {
-            return RES_BAD_SIZE_HEADER;
+        if (digest && header.risu_op == OP_COMPARE) {
+            return recv_digest(ri);
+        }
+        if (delta) {
+            if (header.size > sizeof(delta_frame)) {
+                return RES_BAD_SIZE_HEADER;
+            }
+            respond(RES_OK);
+            res = read_buffer(delta_frame, header.size);
+            if (res == RES_OK) {
+                res = delta_decode(ri, header.size, &size);
+            }
+            if (res != RES_OK) {
+                return res;
+            }
+        } else {
+            /* If we can't store the data, report invalid size. */
+            if (header.size > sizeof(*ri)) {
+                return RES_BAD_SIZE_HEADER;
+            }
+            respond(RES_OK);
+            /* Converting in place takes a whole struct reginfo: a
+             * short one in the trace is followed by other records.
+             */
+            if (header.size == sizeof(*ri)) {
+                res = read_buffer_view(&p, ri, header.size, REGINFO_ALIGN);
+                ri = *pri = (struct reginfo *)p;
+            } else {
+                res = read_buffer(ri, header.size);
+            }
+            size = header.size;
         }
-        respond(RES_OK);
-        res = read_buffer(ri, header.size);
         reginfo_arch_to_host(ri);
-        if (res == RES_OK && header.size != reginfo_size(ri)) {
+        if (res == RES_OK && size != reginfo_size(ri)) {
             /* The payload size is not self-consistent with the data. */
             return RES_BAD_SIZE_REGINFO;
         }
         return res;
 
     case OP_COMPAREMEM:
+        if (digest) {
+            return recv_memdigest();
+        }
         if (header.size != MEMBLOCKLEN) {
             return RES_BAD_SIZE_MEMBLOCK;
         }
         respond(RES_OK);
-        return read_buffer(other_memblock, MEMBLOCKLEN);
+        res = read_buffer_view(&p, other_memblock, MEMBLOCKLEN, 1);
+        master_memblock = (uint8_t *)p;
+        return res;
 
     case OP_SETMEMBLOCK:
     case OP_GETMEMBLOCK:
@@ -316,21 +1426,68 @@ static RisuResult recv_register_info(struct reginfo *ri)
     }
 }
 
-static RisuResult recv_and_compare_register_info(void *uc, void *siaddr)
+/* Receive the master's hash of the checkpoints folded before op's, and
+ * compare it with ours.
+ */
+static RisuResult recv_sample(RisuOp op)
+{
+    RisuResult res;
+    uint64_t hash;
+    size_t folded;
+
+    res = read_buffer(&header, sizeof(header));
+    if (res != RES_OK) {
+        return res;
+    }
+    header_arch_to_host(&header);
+    if (header.magic != RISU_MAGIC) {
+        return RES_BAD_MAGIC;
+    }
+    if (header.risu_op != OP_SAMPLE) {
+        return RES_MISMATCH_OP;
+    }
+    if (header.size != DIGEST_LEN) {
+        return RES_BAD_SIZE_HEADER;
+    }
+    respond(RES_OK);
+    res = read_buffer(digest_frame, DIGEST_LEN);
+    if (res != RES_OK) {
+        return res;
+    }
+    digest_decode(&hash, &folded);
+    if (hash != sample_hash || folded != sample_folded) {
+        return RES_RERUN;
+    }
+    sample_checked(op);
+    respond(RES_OK);
+    return RES_OK;
+}
+
+/* Compare the checkpoint for op, whose registers are in ri[APPRENTICE],
+ * with the master's.
+ */
+static RisuResult recv_checkpoint(RisuOp op, void *uc, void *siaddr)
 {
     arch_ptr_t paramreg;
     RisuResult res;
-    RisuOp op;
 
-    reginfo_init(&ri[APPRENTICE], uc, siaddr);
-    op = get_risuop(&ri[APPRENTICE]);
-    if (op == OP_SIGILL) {
-        illegal_instructions++;
-        if (is_setup)
-            return RES_OK;
+    switch (sample_checkpoint(op)) {
+    case SAMPLE_FOLD:
+        sample_fold(&ri[APPRENTICE]);
+        /* fall through */
+    case SAMPLE_SKIP:
+        sample_skip(op, &ri[APPRENTICE], uc);
+        return RES_OK;
+    case SAMPLE_CHECK:
+        res = recv_sample(op);
+        if (res != RES_OK) {
+            goto done;
+        }
+        break;
     }
 
-    res = recv_register_info(&ri[MASTER]);
+    master_ri = &ri[MASTER];
+    res = recv_register_info(&master_ri);
     if (res != RES_OK) {
         goto done;
     }
@@ -348,7 +1505,7 @@ static RisuResult recv_and_compare_register_info(void *uc, void *siaddr)
             header.risu_op != OP_TESTEND &&
             header.risu_op != OP_SIGILL) {
             res = RES_MISMATCH_OP;
-        } else if (!is_setup && !reginfo_is_eq(&ri[MASTER], &ri[APPRENTICE])) {
+        } else if (!is_setup && !reginfo_is_eq(master_ri, &ri[APPRENTICE])) {
             /* register mismatch */
             res = RES_MISMATCH_REG;
         } else if (op != header.risu_op) {
@@ -356,8 +1513,11 @@ static RisuResult recv_and_compare_register_info(void *uc, void *siaddr)
             res = RES_MISMATCH_OP;
         } else if (op == OP_TESTEND) {
             res = RES_END;
+        } else if (op != OP_SIGILL && spill_pc) {
+            /* The image has moved on since: see recv_spilled(). */
+            spill_matched = true;
         } else if (op != OP_SIGILL) {
-            reginfo_update(&ri[MASTER], uc, siaddr);
+            reginfo_update(master_ri, uc, siaddr);
         }
         break;
 
@@ -384,7 +1544,7 @@ static RisuResult recv_and_compare_register_info(void *uc, void *siaddr)
             res = RES_MISMATCH_OP;
             break;
         }
-        if (memcmp(memblock, other_memblock, MEMBLOCKLEN) != 0) {
+        if (memcmp(memblock, master_memblock, MEMBLOCKLEN) != 0) {
             /* memory mismatch */
             res = RES_MISMATCH_MEM;
         }
@@ -404,10 +1564,66 @@ static RisuResult recv_and_compare_register_info(void *uc, void *siaddr)
     }
 
  done:
-    /* On error, tell master to exit. */
-    respond(res == RES_OK ? RES_OK : RES_END);
+    if (sample_folded && res != RES_OK && res != RES_END && res != RES_BAD_IO) {
+        /* It may have gone wrong at one of those first. */
+        res = RES_RERUN;
+    }
+    /* On error, tell master why we are stopping. */
+    respond(res);
+    return res;
+}
+
+#ifdef RISU_HAVE_SPILL
+static RisuResult recv_spilled(void *uc, void *siaddr)
+{
+    struct spillinfo *slot;
+    RisuResult res = RES_OK;
+    uint32_t i, count;
+
+    slot = spill_ring(&ri[APPRENTICE], &count);
+    if (!slot) {
+        return RES_BAD_IO;
+    }
+    /* The trap isn't a checkpoint, each slot is. */
+    signal_count--;
+    for (i = 0; i < count && res == RES_OK; i++) {
+        signal_count++;
+        spill_pc = reginfo_init_spill(&ri[APPRENTICE], &slot[i]);
+        spill_matched = false;
+        res = recv_checkpoint(OP_COMPARE, uc, siaddr);
+    }
+    if (res == RES_OK) {
+        spill_pc = 0;
+        /* The image ran on past the slots, so differences the
+         * comparison lets through are only taken over now, from the
+         * last one (if it was compared in full).
+         */
+        if (spill_matched) {
+            reginfo_update_spill(master_ri, &slot[count - 1], uc);
+        }
+    }
     return res;
 }
+#endif
+
+static RisuResult recv_and_compare_register_info(void *uc, void *siaddr)
+{
+    RisuOp op;
+
+    reginfo_init(&ri[APPRENTICE], uc, siaddr);
+    op = get_risuop(&ri[APPRENTICE]);
+    if (op == OP_SIGILL) {
+        illegal_instructions++;
+        if (is_setup)
+            return RES_OK;
+    }
+#ifdef RISU_HAVE_SPILL
+    if (op == OP_COMPARESPILL) {
+        return recv_spilled(uc, siaddr);
+    }
+#endif
+    return recv_checkpoint(op, uc, siaddr);
+}
 
 static void apprentice_sigill(int sig, arch_siginfo_t *si, void *uc)
 {
@@ -423,7 +1639,7 @@ static void apprentice_sigill(int sig, arch_siginfo_t *si, void *uc)
     if (r == RES_OK) {
         advance_pc(uc);
     } else {
-        signal_pc = get_uc_pc(uc, si->si_addr);
+        signal_pc = checkpoint_pc(uc, si->si_addr);
 #ifdef RISU_MACOS9
         longjmp(jmpbuf, r);
 #else
@@ -457,9 +1673,9 @@ static void set_sigill_handler(sig_handler_fn *fn)
 #endif
 }
 
-uintptr_t image_start_address;
-entrypoint_fn *image_start;
-size_t image_size;
+RISU_TLS uintptr_t image_start_address;
+RISU_TLS entrypoint_fn *image_start;
+RISU_TLS size_t image_size;
 
 static void load_image(const char *imgfile)
 {
@@ -513,29 +1729,586 @@ static void unload_image()
 {
 #ifdef RISU_MACOS9
     free((void*)image_start_address);
+#else
+    munmap((void *)image_start, image_size);
 #endif
     image_start_address = NULL;
     image_start = NULL;
 }
 
-static void close_comm()
+/* After RES_RERUN: start again with a fresh copy of the image, which
+ * writes to its memory block, and compare in full from where the
+ * sampled checkpoints were last found to match.
+ */
+static void sample_restart(void)
+{
+    fprintf(stderr, "sampled checkpoints differ: running the image again, "
+            "comparing in full after %zd compares\n", sample_good);
+    sample_rerun = true;
+    spill_pc = 0;
+    sample_count = 0;
+    sample_folded = 0;
+    sample_hash = 0;
+    signal_count = 0;
+    illegal_instructions = 0;
+    is_setup = false;
+    memset(delta_prev, 0, sizeof(delta_prev));
+    memblock = NULL;
+    arch_memblock = 0;
+    unload_image();
+    load_image(image_name);
+}
+
+/* Returns false if a trace could not be finished. */
+static bool close_comm()
+{
+    if (trace) {
+        if (trace_close(trace_file) != RES_OK) {
+            fprintf(stderr, "failed to finish writing the trace file\n");
+            return false;
+        }
+        return true;
+    }
+    if (napprentices > 1) {
+        int i;
+        for (i = 0; i < napprentices; i++) {
+            close(apprentice_fds[i]);
+        }
+        return true;
+    }
+    close(comm_fd);
+    return true;
+}
+
+static void print_loc()
+{
+    fprintf(stderr, " at image + 0x%" PRIxARCHPTR, signal_pc - get_arch_start_address());
+}
+
+static void print_stats()
+{
+    fprintf(stderr, " after %zd checkpoints and %zd illegal instructions\n", signal_count - illegal_instructions, illegal_instructions);
+}
+
+/* Session handshake.
+ *
+ * Before the image starts, the master sends a hello describing itself
+ * and the session options, and the apprentice answers with its own.
+ * Both ends check the pair the same way, so they either both go ahead
+ * or both give up with the same message. The apprentice adopts the
+ * master's options. All fields are big endian.
+ */
+#define HELLO_MAGIC   ((uint32_t)(('R' << 24) | ('H' << 16) | ('L' << 8) | 'O'))
+#define HELLO_VERSION 2
+
+#define SESSION_PIPELINE (1 << 0)
+#define SESSION_DELTA    (1 << 1)
+#define SESSION_DIGEST   (1 << 2)
+#define SESSION_DAEMON   (1 << 3)
+
+#define HELLO_NAME_LEN 256
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t big_endian;    /* get_arch_big_endian() */
+    uint32_t reginfo_size;  /* sizeof(struct reginfo) */
+    uint32_t memblock_len;  /* MEMBLOCKLEN */
+    uint32_t options;       /* SESSION_* (master only) */
+    uint32_t compress;      /* master: COMM_COMPRESS_*, apprentice: mask */
+    uint32_t sample;        /* --sample N (master only) */
+    uint32_t image_hash[2]; /* risu_hash64() of the image, high word first */
+    char image_name[HELLO_NAME_LEN];
+} session_hello_t;
+
+/* The apprentice's image, as given in its hello */
+static RISU_TLS uint64_t peer_image_hash;
+static RISU_TLS char peer_image_name[HELLO_NAME_LEN];
+
+static void hello_swap(session_hello_t *h)
+{
+    h->magic = be32(h->magic);
+    h->version = be32(h->version);
+    h->big_endian = be32(h->big_endian);
+    h->reginfo_size = be32(h->reginfo_size);
+    h->memblock_len = be32(h->memblock_len);
+    h->options = be32(h->options);
+    h->compress = be32(h->compress);
+    h->sample = be32(h->sample);
+    h->image_hash[0] = be32(h->image_hash[0]);
+    h->image_hash[1] = be32(h->image_hash[1]);
+}
+
+static bool hello_check(session_hello_t *m, session_hello_t *a)
+{
+    if (m->magic != HELLO_MAGIC || a->magic != HELLO_MAGIC) {
+        fprintf(stderr, "Error: peer did not send a session hello\n");
+    } else if (m->version != a->version) {
+        fprintf(stderr, "Error: protocol version mismatch "
+                "(master %u, apprentice %u)\n", m->version, a->version);
+    } else if (m->big_endian != a->big_endian) {
+        fprintf(stderr, "Error: master and apprentice disagree on the "
+                "architecture byte order\n");
+    } else if (m->reginfo_size != a->reginfo_size) {
+        fprintf(stderr, "Error: reginfo size mismatch "
+                "(master %u, apprentice %u)\n",
+                m->reginfo_size, a->reginfo_size);
+    } else if (m->memblock_len != a->memblock_len) {
+        fprintf(stderr, "Error: memory block size mismatch "
+                "(master %u, apprentice %u)\n",
+                m->memblock_len, a->memblock_len);
+    } else if (m->compress >= 32 || !(a->compress & (1u << m->compress))) {
+        fprintf(stderr, "Error: apprentice does not support %s "
+                "compression\n", comm_compress_name(m->compress));
+    } else {
+        return true;
+    }
+    return false;
+}
+
+#ifndef RISU_MACOS9
+/* Master daemon.
+ *
+ * With --daemon the master keeps listening on its port and forks a
+ * child for every apprentice that connects; the child runs one session
+ * exactly like a normal master and exits. The apprentice's hello
+ * names its image by content hash. The daemon keeps every file in
+ * --image-dir mapped (rescanning when the directory changes), so a
+ * session only has to pick one: being a private mapping, the child's
+ * copy is a fresh one even if an earlier session wrote to it.
+ */
+typedef struct {
+    uint64_t hash;
+    char *name;
+    void *addr;             /* NULL if the file has gone */
+    size_t size;
+    ino_t ino;              /* to see the file has changed since */
+    struct timespec mtime;
+} daemon_image_t;
+
+static daemon_image_t *daemon_images;
+static int daemon_nimages;
+static struct timespec daemon_dir_mtime;
+
+static daemon_image_t *daemon_named_image(const char *name)
+{
+    int i;
+
+    for (i = 0; i < daemon_nimages; i++) {
+        if (strcmp(daemon_images[i].name, name) == 0) {
+            return &daemon_images[i];
+        }
+    }
+    return NULL;
+}
+
+/* (Re)load img from its file if that has changed since, or is new.
+ * Images are regenerated under the same name, usually in place.
+ */
+static void daemon_check_image(daemon_image_t *img)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    void *addr;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", image_dir, img->name);
+    fd = open(path, O_RDONLY);
+    if (fd >= 0 && (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+                    || !st.st_size)) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd >= 0 && img->addr && st.st_ino == img->ino
+        && (size_t)st.st_size == img->size
+        && st.st_mtim.tv_sec == img->mtime.tv_sec
+        && st.st_mtim.tv_nsec == img->mtime.tv_nsec) {
+        close(fd);
+        return;
+    }
+
+    if (img->addr) {
+        munmap(img->addr, img->size);
+        img->addr = NULL;
+    }
+    if (fd < 0) {
+        return;
+    }
+    addr = mmap(0, st.st_size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return;
+    }
+    img->addr = addr;
+    img->size = st.st_size;
+    img->ino = st.st_ino;
+    img->mtime = st.st_mtim;
+    img->hash = risu_hash64(addr, img->size, 0);
+}
+
+static void daemon_scan_images(void)
+{
+    struct stat st;
+    struct dirent *de;
+    DIR *dir;
+    int i;
+
+    if (stat(image_dir, &st) != 0) {
+        perror(image_dir);
+        exit(EXIT_FAILURE);
+    }
+    /* Files rewritten in place don't change the directory. */
+    for (i = 0; i < daemon_nimages; i++) {
+        daemon_check_image(&daemon_images[i]);
+    }
+    if (daemon_nimages && st.st_mtim.tv_sec == daemon_dir_mtime.tv_sec
+        && st.st_mtim.tv_nsec == daemon_dir_mtime.tv_nsec) {
+        return;
+    }
+    daemon_dir_mtime = st.st_mtim;
+
+    dir = opendir(image_dir);
+    if (!dir) {
+        perror(image_dir);
+        exit(EXIT_FAILURE);
+    }
+    while ((de = readdir(dir)) != NULL) {
+        daemon_image_t *img;
+
+        if (de->d_name[0] == '.' || daemon_named_image(de->d_name)) {
+            continue;
+        }
+        daemon_images = (daemon_image_t *)
+            realloc(daemon_images, (daemon_nimages + 1) * sizeof(*img));
+        if (!daemon_images) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        img = &daemon_images[daemon_nimages];
+        memset(img, 0, sizeof(*img));
+        img->name = strdup(de->d_name);
+        daemon_check_image(img);
+        if (!img->addr) {
+            /* Not an image; look again when the directory changes. */
+            free(img->name);
+            continue;
+        }
+        daemon_nimages++;
+    }
+    closedir(dir);
+}
+
+/* Pick the image the apprentice asked for. */
+static RisuResult daemon_find_image(void)
+{
+    const char *base = strrchr(peer_image_name, '/');
+    daemon_image_t *named;
+    int i;
+
+    /* It may have been regenerated since the daemon last looked. */
+    named = daemon_named_image(base ? base + 1 : peer_image_name);
+    if (named) {
+        daemon_check_image(named);
+    }
+    for (i = 0; i < daemon_nimages; i++) {
+        if (daemon_images[i].addr
+            && daemon_images[i].hash == peer_image_hash) {
+            image_start = (entrypoint_fn *)daemon_images[i].addr;
+            image_start_address = (uintptr_t)daemon_images[i].addr;
+            image_size = daemon_images[i].size;
+            fprintf(stderr, "session %d: image %s\n", (int)getpid(),
+                    daemon_images[i].name);
+            return RES_OK;
+        }
+    }
+    fprintf(stderr, "session %d: no image matches %s\n", (int)getpid(),
+            peer_image_name);
+    return RES_BAD_IMAGE;
+}
+
+static void daemon_reap(void)
+{
+    int status;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        fprintf(stderr, "session %d: finished, status %d\n", (int)pid,
+                WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    }
+}
+
+/* Only returns (with the connection) in the child for a new session. */
+static int run_daemon(int port)
+{
+    int sock = master_listen(port, 16);
+
+    daemon_scan_images();
+    fprintf(stderr, "master daemon: %d images in %s, port %d\n",
+            daemon_nimages, image_dir, port);
+
+    for (;;) {
+        struct pollfd pfd;
+        int nsock;
+        pid_t pid;
+
+        /* Finished sessions are reaped while waiting, too. */
+        pfd.fd = sock;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 1000) <= 0) {
+            daemon_reap();
+            continue;
+        }
+        nsock = master_accept(sock);
+        daemon_reap();
+        daemon_scan_images();
+        pid = fork();
+        if (pid == 0) {
+            close(sock);
+            return nsock;
+        }
+        if (pid < 0) {
+            perror("fork");
+        } else {
+            fprintf(stderr, "session %d: started\n", (int)pid);
+        }
+        close(nsock);
+    }
+}
+#else
+static RisuResult daemon_find_image(void)
+{
+    return RES_BAD_IMAGE;
+}
+#endif
+
+static void session_hello(int fd)
+{
+#ifndef RISU_MACOS9
+    session_hello_t mine, theirs;
+    session_hello_t *m, *a;
+    RisuResult res;
+    uint64_t hash;
+    uint32_t options;
+
+    mine.magic = HELLO_MAGIC;
+    mine.version = HELLO_VERSION;
+    mine.big_endian = get_arch_big_endian();
+    mine.reginfo_size = sizeof(struct reginfo);
+    mine.memblock_len = MEMBLOCKLEN;
+    mine.options = (pipeline ? SESSION_PIPELINE : 0)
+                 | (delta ? SESSION_DELTA : 0)
+                 | (digest ? SESSION_DIGEST : 0);
+    mine.compress = ismaster ? compress_algo : comm_compress_supported();
+    mine.sample = sample_n;
+    if (daemon_mode) {
+        mine.options |= SESSION_DAEMON;
+    }
+    hash = image_start ? risu_hash64((void *)image_start, image_size, 0) : 0;
+    mine.image_hash[0] = (uint32_t)(hash >> 32);
+    mine.image_hash[1] = (uint32_t)hash;
+    memset(mine.image_name, 0, HELLO_NAME_LEN);
+    if (image_name) {
+        strncpy(mine.image_name, image_name, HELLO_NAME_LEN - 1);
+    }
+    options = mine.options & ~SESSION_DAEMON;
+    hello_swap(&mine);
+
+    if (ismaster) {
+        res = send_data_pkt(fd, &mine, sizeof(mine));
+        if (res == RES_OK) {
+            res = recv_data_pkt(fd, &theirs, sizeof(theirs));
+            send_response_byte(fd, res);
+        }
+        m = &mine;
+        a = &theirs;
+    } else {
+        res = recv_data_pkt(fd, &theirs, sizeof(theirs));
+        send_response_byte(fd, res);
+        if (res == RES_OK) {
+            res = send_data_pkt(fd, &mine, sizeof(mine));
+        }
+        m = &theirs;
+        a = &mine;
+    }
+    if (res != RES_OK) {
+        fprintf(stderr, "Error: session handshake failed "
+                "(incompatible risu versions?)\n");
+        exit(EXIT_FAILURE);
+    }
+    hello_swap(m);
+    hello_swap(a);
+    if (!hello_check(m, a)) {
+        exit(EXIT_FAILURE);
+    }
+
+    a->image_name[HELLO_NAME_LEN - 1] = 0;
+    peer_image_hash = ((uint64_t)a->image_hash[0] << 32) | a->image_hash[1];
+    memcpy(peer_image_name, a->image_name, HELLO_NAME_LEN);
+
+    if (m->options & SESSION_DAEMON) {
+        /* The daemon now looks for the apprentice's image. */
+        if (ismaster) {
+            res = daemon_find_image();
+            send_response_byte(fd, res);
+        } else {
+            res = recv_response_byte(fd);
+        }
+        if (res != RES_OK) {
+            fprintf(stderr, "Error: the master has no copy of image %s\n",
+                    peer_image_name[0] ? peer_image_name : image_name);
+            exit(EXIT_FAILURE);
+        }
+    } else if (ismaster && peer_image_hash != hash) {
+        fprintf(stderr, "warning: apprentice image %s differs from ours\n",
+                peer_image_name);
+    }
+
+    if (!ismaster && ((m->options & ~SESSION_DAEMON) != options
+                      || m->sample != (uint32_t)sample_n)) {
+        fprintf(stderr, "using the master's session options\n");
+    }
+    pipeline = (m->options & SESSION_PIPELINE) != 0;
+    delta = (m->options & SESSION_DELTA) != 0;
+    digest = (m->options & SESSION_DIGEST) != 0;
+    sample_n = (int)m->sample;
+    compress_algo = m->compress;
+#endif
+}
+
+/* Switch on what session_hello() agreed on. */
+static void session_start(void)
 {
-#ifdef HAVE_ZLIB
-    if (trace && comm_fd != STDOUT_FILENO) {
-        gzclose(gz_trace_file);
+#ifndef RISU_MACOS9
+    if (compress_algo != COMM_COMPRESS_NONE) {
+        if (comm_set_compression(compress_algo) < 0) {
+            fprintf(stderr, "Error: cannot set up %s compression\n",
+                    comm_compress_name(compress_algo));
+            exit(EXIT_FAILURE);
+        }
+        fprintf(stderr, "using %s compression\n",
+                comm_compress_name(compress_algo));
+    }
+#endif
+}
+
+#ifndef RISU_MACOS9
+static void connect_apprentices(int port)
+{
+    int sock = master_listen(port, napprentices);
+    int i;
+
+    fprintf(stderr, "master: waiting for %d apprentices on port %d...\n",
+            napprentices, port);
+    for (i = 0; i < napprentices; i++) {
+        apprentice_fds[i] = master_accept(sock);
+        verdicts[i] = RES_OK;
+        verdict_at[i] = (size_t)-1;
+        fprintf(stderr, "master: apprentice %d connected\n", i);
+        session_hello(apprentice_fds[i]);
+    }
+    close(sock);
+    comm_fd = apprentice_fds[0];
+    /* Apprentices that are done hang up, the others carry on. */
+    signal(SIGPIPE, SIG_IGN);
+}
+#endif
+
+#ifndef RISU_MACOS9
+/* --spawn: run the apprentice command ourselves (napprentices times),
+ * connected through a socketpair or the shared memory channel.
+ */
+static void spawn_apprentices(const char *shm_path)
+{
+    int i;
+
+    if (shm_path) {
+        comm_fd = shm_master_create(shm_path);
+        spawn_apprentice(spawn_cmd, shm_path, &spawn_pids[nspawned++]);
+        shm_master_wait(shm_path);
+        return;
+    }
+    for (i = 0; i < napprentices; i++) {
+        apprentice_fds[i] = spawn_apprentice(spawn_cmd, NULL,
+                                             &spawn_pids[nspawned++]);
+        verdicts[i] = RES_OK;
+        verdict_at[i] = (size_t)-1;
+        fprintf(stderr, "master: spawned apprentice %d (pid %d)\n",
+                i, spawn_pids[i]);
+        session_hello(apprentice_fds[i]);
+    }
+    comm_fd = apprentice_fds[0];
+    signal(SIGPIPE, SIG_IGN);
+}
+
+/* Wait for the spawned apprentices, returns false if any failed. */
+static bool wait_spawned(void)
+{
+    bool ok = true;
+    int i, status;
+
+    for (i = 0; i < nspawned; i++) {
+        if (waitpid(spawn_pids[i], &status, 0) < 0) {
+            perror("waitpid");
+            ok = false;
+        } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "apprentice %d (pid %d) failed, status %d\n",
+                    i, spawn_pids[i],
+                    WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+            ok = false;
+        }
+    }
+    return ok;
+}
+#endif
+
+static const char *result_name(RisuResult res)
+{
+    switch (res) {
+    case RES_OK:
+        return "running";
+    case RES_END:
+        return "done";
+    case RES_MISMATCH_REG:
+        return "register mismatch";
+    case RES_MISMATCH_MEM:
+        return "memory mismatch";
+    case RES_MISMATCH_OP:
+        return "header mismatch";
+    case RES_BAD_IO:
+        return "i/o error";
+    case RES_BAD_MAGIC:
+        return "bad magic number";
+    case RES_BAD_SIZE_HEADER:
+    case RES_BAD_SIZE_REGINFO:
+    case RES_BAD_SIZE_MEMBLOCK:
+    case RES_BAD_SIZE_ZERO:
+        return "bad payload size";
+    case RES_BAD_OP:
+        return "bad opcode";
+    case RES_SIGBUS:
+        return "bus error";
+    case RES_BAD_IMAGE:
+        return "unknown image";
+    case RES_RERUN:
+        return "sampled checkpoints differ";
+    case RES_RESEND:
+        break;
     }
-#endif
-    close(comm_fd);
+    return "unexpected result";
 }
 
-static void print_loc()
+static void print_verdicts(void)
 {
-    fprintf(stderr, " at image + 0x%" PRIxARCHPTR, signal_pc - get_arch_start_address());
-}
+    int i;
 
-static void print_stats()
-{
-    fprintf(stderr, " after %zd checkpoints and %zd illegal instructions\n", signal_count - illegal_instructions, illegal_instructions);
+    for (i = 0; i < napprentices; i++) {
+        fprintf(stderr, "apprentice %d: %s", i, result_name(verdicts[i]));
+        if (verdicts[i] != RES_END) {
+            fprintf(stderr, " (master at checkpoint %zd)", verdict_at[i]);
+        }
+        fprintf(stderr, "\n");
+    }
 }
 
 static int master(void)
@@ -548,6 +2321,9 @@ static int master(void)
 #endif
 
     switch (res) {
+    case RES_RERUN:
+        sample_restart();
+        /* fall through */
     case RES_OK:
         set_sigill_handler(&master_sigill);
         fprintf(stderr, "starting image at 0x%" PRIxARCHPTR "\n",
@@ -559,12 +2335,18 @@ static int master(void)
 
     case RES_END:
         fprintf(stderr, "done"); print_stats();
-        close_comm();
-        result = EXIT_SUCCESS;
+        if (napprentices > 1) {
+            print_verdicts();
+        }
+        result = close_comm() ? EXIT_SUCCESS : EXIT_FAILURE;
         break;
 
     case RES_BAD_IO:
         fprintf(stderr, "i/o error"); print_loc(); print_stats();
+        if (napprentices > 1) {
+            print_verdicts();
+        }
+        close_comm();
         result = EXIT_FAILURE;
         break;
 
@@ -574,18 +2356,42 @@ static int master(void)
         result = EXIT_FAILURE;
         break;
 
+    case RES_MISMATCH_REG:
+    case RES_MISMATCH_MEM:
+    case RES_MISMATCH_OP:
+    case RES_BAD_MAGIC:
+    case RES_BAD_SIZE_HEADER:
+    case RES_BAD_SIZE_REGINFO:
+    case RES_BAD_SIZE_MEMBLOCK:
+    case RES_BAD_SIZE_ZERO:
+    case RES_BAD_OP:
+        /* The apprentice stopped the run and says why. */
+        fprintf(stderr, "done"); print_stats();
+        fprintf(stderr, "apprentice: %s\n", result_name(res));
+        close_comm();
+        result = EXIT_SUCCESS;
+        break;
+
     default:
         fprintf(stderr, "unexpected result %d", res); print_loc(); print_stats();
         close_comm();
         result = EXIT_FAILURE;
         break;
     }
+    if (tee_res != RES_OK && tee_res != RES_END && napprentices <= 1) {
+        fprintf(stderr, "apprentice stopped after %zd checkpoints, "
+                "trace recorded to the end\n", tee_stop_at);
+    }
     return result;
 }
 
 static const char *op_name(RisuOp op)
 {
     switch (op) {
+    case OP_METADATA:
+        return "METADATA";
+    case OP_SAMPLE:
+        return "SAMPLE";
     case OP_SIGILL:
         return "SIGILL";
     case OP_COMPARE:
@@ -602,6 +2408,8 @@ static const char *op_name(RisuOp op)
         return "SETUPBEGIN";
     case OP_SETUPEND:
         return "SETUPEND";
+    case OP_COMPARESPILL:
+        return "COMPARESPILL";
     }
     abort();
     return "";
@@ -610,6 +2418,9 @@ static const char *op_name(RisuOp op)
 static int apprentice(void)
 {
     int result;
+
+    master_ri = &ri[MASTER];
+    master_memblock = other_memblock;
 #ifdef RISU_MACOS9
     RisuResult res = (RisuResult)setjmp(jmpbuf);
 #else
@@ -617,6 +2428,9 @@ static int apprentice(void)
 #endif
 
     switch (res) {
+    case RES_RERUN:
+        sample_restart();
+        /* fall through */
     case RES_OK:
         set_sigill_handler(&apprentice_sigill);
         fprintf(stderr, "starting image at 0x%" PRIxARCHPTR "\n",
@@ -634,10 +2448,10 @@ static int apprentice(void)
     case RES_MISMATCH_REG:
         fprintf(stderr, "Mismatch reg"); print_loc(); print_stats();
         fprintf(stderr, "master reginfo:\n");
-        reginfo_dump(&ri[MASTER], stderr);
+        reginfo_dump(master_ri, stderr);
         fprintf(stderr, "apprentice reginfo:\n");
         reginfo_dump(&ri[APPRENTICE], stderr);
-        reginfo_dump_mismatch(&ri[MASTER], &ri[APPRENTICE], stderr);
+        reginfo_dump_mismatch(master_ri, &ri[APPRENTICE], stderr);
         result = EXIT_FAILURE;
         break;
 
@@ -672,7 +2486,7 @@ static int apprentice(void)
         break;
 
     case RES_BAD_SIZE_REGINFO:
-        fprintf(stderr, "Payload size %u in header doesn't match received payload size %d", header.size, reginfo_size(&ri[MASTER])); print_loc(); print_stats();
+        fprintf(stderr, "Payload size %u in header doesn't match received payload size %d", header.size, reginfo_size(master_ri)); print_loc(); print_stats();
         result = EXIT_FAILURE;
         break;
 
@@ -704,16 +2518,162 @@ static int apprentice(void)
     return result;
 }
 
-static int ismaster;
+#ifndef NO_SIGNAL
+/* Signals are handled on an alternate stack, one per thread. */
+static void set_alt_stack(void)
+{
+    stack_t ss;
+
+    /* create alternate stack */
+    ss.ss_sp = malloc(SIGSTKSZ);
+    if (ss.ss_sp == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    ss.ss_size = SIGSTKSZ;
+    ss.ss_flags = 0;
+    if (sigaltstack(&ss, NULL) == -1) {
+        perror("sigaltstac");
+        exit(EXIT_FAILURE);
+    }
+}
+#endif
+
+#ifdef RISU_HAVE_THREADS
+/* Several images.
+ *
+ * Given more than one image, risu runs each on a thread of its own, so
+ * that one process (one qemu-user, say) can keep several cores busy.
+ * Image i talks to its peer on port + i, or through shared memory
+ * <file>.i, so both ends must be given the same images in the same
+ * order. Everything a run changes is thread local (RISU_TLS): its
+ * image, memblock, connection, counts and the SIGILL handler's jump
+ * buffer. The options are shared, except for the session options the
+ * handshake can change, which each thread starts from a copy of.
+ */
+typedef struct {
+    pthread_t thread;
+    const char *imgfile;
+    const char *hostname;
+    int port;
+    char *shm_path;     /* or NULL for TCP */
+    int pipeline, delta, digest, sample_n, compress_algo;
+    int result;
+} risu_job_t;
+
+static void *run_job(void *arg)
+{
+    risu_job_t *job = (risu_job_t *)arg;
+
+    pipeline = job->pipeline;
+    delta = job->delta;
+    digest = job->digest;
+    sample_n = job->sample_n;
+    compress_algo = job->compress_algo;
+
+    load_image(job->imgfile);
+    image_name = job->imgfile;
+    if (job->shm_path) {
+        fprintf(stderr, "%s shared memory %s\n",
+                ismaster ? "master" : "apprentice", job->shm_path);
+        comm_fd = ismaster ? shm_master_connect(job->shm_path)
+                           : shm_apprentice_connect(job->shm_path);
+    } else if (ismaster) {
+        fprintf(stderr, "master port %d\n", job->port);
+        comm_fd = master_connect(job->port);
+    } else {
+        fprintf(stderr, "apprentice host %s port %d\n", job->hostname,
+                job->port);
+        comm_fd = apprentice_connect(job->hostname, job->port);
+    }
+    session_hello(comm_fd);
+    session_start();
+    set_alt_stack();
+    arch_init();
+
+    fprintf(stderr, "starting %s for %s\n",
+            ismaster ? "master" : "apprentice", image_name);
+    job->result = ismaster ? master() : apprentice();
+    unload_image();
+    return NULL;
+}
+
+static int run_jobs(char **images, int n, const char *hostname, int port,
+                    const char *shm_path)
+{
+    risu_job_t *jobs = (risu_job_t *)calloc(n, sizeof(risu_job_t));
+    int result = EXIT_SUCCESS;
+    int i, err;
+
+    if (!jobs) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    if (pipeline) {
+        /*
+         * Signal dispositions are per process, not per thread, so this
+         * is done once here for every job rather than in run_job().
+         */
+        signal(SIGPIPE, SIG_IGN);
+    }
+    for (i = 0; i < n; i++) {
+        risu_job_t *job = &jobs[i];
+
+        job->imgfile = images[i];
+        job->hostname = hostname;
+        job->port = port + i;
+        if (shm_path) {
+            size_t len = strlen(shm_path) + 16;
+
+            job->shm_path = (char *)malloc(len);
+            snprintf(job->shm_path, len, "%s.%d", shm_path, i);
+        }
+        job->pipeline = pipeline;
+        job->delta = delta;
+        job->digest = digest;
+        job->sample_n = sample_n;
+        job->compress_algo = compress_algo;
+        job->result = EXIT_FAILURE;
+        err = pthread_create(&job->thread, NULL, run_job, job);
+        if (err) {
+            fprintf(stderr, "cannot start a thread for %s: %s\n",
+                    images[i], strerror(err));
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < n; i++) {
+        pthread_join(jobs[i].thread, NULL);
+    }
+
+    /* Their own verdicts are lost in the others' output. */
+    for (i = 0; i < n; i++) {
+        fprintf(stderr, "%s: %s\n", jobs[i].imgfile,
+                jobs[i].result == EXIT_SUCCESS ? "ok" : "FAILED");
+        if (jobs[i].result != EXIT_SUCCESS) {
+            result = EXIT_FAILURE;
+        }
+        free(jobs[i].shm_path);
+    }
+    free(jobs);
+    return result;
+}
+#endif
 
 static void usage(void)
 {
     fprintf(stderr,
-            "Usage: risu [--master] [--host <ip>] [--port <port>] <image file>"
+            "Usage: risu [--master] [--host <ip>] [--port <port>] [--shm <file>] "
+            "[--pipeline] [--delta] [--digest] [--sample <n>] "
+            "[--compress <algo>] [--apprentices <n>] <image file>...\n"
+            "       risu --master --daemon [--image-dir <dir>] [options]\n"
+            "       risu --master --spawn <command> [options] <image file>"
             "\n\n");
     fprintf(stderr,
             "Run through the pattern file verifying each instruction\n");
-    fprintf(stderr, "between master and apprentice risu processes.\n\n");
+    fprintf(stderr, "between master and apprentice risu processes.\n");
+    fprintf(stderr, "Several image files are run at once, each on a thread "
+            "of its own,\nusing port + i or shared memory <file>.i for "
+            "image i.\n\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  --master          Be the master (server)\n");
     fprintf(stderr, "  -t, --trace=FILE  Record/playback " TRACE_TYPE " trace file\n");
@@ -723,6 +2683,81 @@ static void usage(void)
     fprintf(stderr,
             "  -p, --port=PORT   Specify the port to connect to/listen on "
             "(default 9191)\n");
+    fprintf(stderr,
+            "  --pipeline        Stream checkpoints without waiting for the "
+            "apprentice\n"
+            "                    (master only)\n");
+    fprintf(stderr,
+            "  --delta           Only send the registers that changed since "
+            "the last\n"
+            "                    checkpoint (master, and when replaying such "
+            "a trace)\n");
+    fprintf(stderr,
+            "  --digest          Only send a hash of the registers unless "
+            "they differ\n"
+            "                    (master only, not with --pipeline or "
+            "--trace)\n");
+    fprintf(stderr,
+            "  --sample=N        Only compare every Nth checkpoint in full, "
+            "and the others\n"
+            "                    by hash, running again in full if they "
+            "differ (master\n"
+            "                    only, not with --pipeline, --digest or "
+            "--trace)\n");
+    fprintf(stderr,
+            "  --compress=ALGO   Compress the data sent over the connection "
+            "(master only):\n"
+            "                    none, lz4 or zstd\n");
+    fprintf(stderr,
+            "  --apprentices=N   Run the image once for N apprentices "
+            "(master only)\n");
+    fprintf(stderr,
+            "  --daemon          Keep serving apprentices, each in a "
+            "session of its own\n"
+            "                    (master only)\n");
+    fprintf(stderr,
+            "  --image-dir=DIR   Images the daemon can run (default: "
+            "current directory)\n");
+    fprintf(stderr,
+            "  --spawn=CMD       Run the apprentice command CMD ourselves "
+            "(master only)\n");
+    fprintf(stderr,
+            "  --fd=FD           Talk to the master through file descriptor "
+            "FD\n");
+    fprintf(stderr,
+            "  --trace-format=F  Record an indexed (default) or stream trace"
+            "\n"
+            "                    (stream is the default for -t -)\n");
+    fprintf(stderr,
+            "  --trace-codec=C   Compress traces with none, gzip, zstd or lz4"
+            "\n"
+            "                    (default: %s, none for -t -)\n",
+            trace_codec_name(trace_codec_default()));
+    fprintf(stderr,
+            "  --trace-level=N   Compression level for the trace codec\n");
+    fprintf(stderr,
+            "  --trace-threads=N Compress traces with N worker threads "
+            "(zstd only)\n");
+    fprintf(stderr,
+            "  --trace-layout=L  Store indexed trace frames as rows "
+            "(default) or columns\n");
+    fprintf(stderr,
+            "  --trace-sync      Compress and write the trace from the signal "
+            "handler\n"
+            "                    instead of a writer thread\n");
+    fprintf(stderr,
+            "  --tee=FILE        Also record the " TRACE_TYPE " trace of a "
+            "live run to FILE\n"
+            "                    (master only)\n");
+    fprintf(stderr,
+            "  --trace-cache=DIR Reuse the trace recorded before of the same "
+            "image and\n"
+            "                    options from DIR, or add it there "
+            "(master only)\n");
+    fprintf(stderr,
+            "  --shm=FILE        Talk through shared memory at FILE instead "
+            "of TCP\n"
+            "                    (master and apprentice on the same host)\n");
     if (arch_extra_help) {
         fprintf(stderr, "%s", arch_extra_help);
     }
@@ -736,6 +2771,25 @@ static struct option * setup_options(const char **short_opts)
         {"host", required_argument, 0, 'h'},
         {"port", required_argument, 0, 'p'},
         {"trace", required_argument, 0, 't'},
+        {"pipeline", no_argument, 0, 'P'},
+        {"shm", required_argument, 0, 's'},
+        {"delta", no_argument, 0, 'D'},
+        {"digest", no_argument, 0, 'G'},
+        {"sample", required_argument, 0, 'S'},
+        {"compress", required_argument, 0, 'z'},
+        {"apprentices", required_argument, 0, 'n'},
+        {"daemon", no_argument, &daemon_mode, 1},
+        {"spawn", required_argument, 0, 'e'},
+        {"fd", required_argument, 0, 'f'},
+        {"tee", required_argument, 0, 'T'},
+        {"trace-format", required_argument, 0, 'F'},
+        {"trace-codec", required_argument, 0, 'C'},
+        {"trace-level", required_argument, 0, 'L'},
+        {"trace-threads", required_argument, 0, 'W'},
+        {"trace-layout", required_argument, 0, 'Y'},
+        {"trace-sync", no_argument, &trace_sync, 1},
+        {"trace-cache", required_argument, 0, 'K'},
+        {"image-dir", required_argument, 0, 'i'},
         {0, 0, 0, 0}
     };
     struct option *lopts;
@@ -776,6 +2830,9 @@ int risu_main(int argc, char **argv)
     const char *hostname = "localhost";
     char *imgfile;
     char *trace_fn = NULL;
+    char *shm_path = NULL;
+    const char *comm_fd_arg = NULL;
+    int nimages;
     struct option *longopts;
     const char *shortopts;
     trace = false;
@@ -783,6 +2840,36 @@ int risu_main(int argc, char **argv)
     illegal_instructions = 0;
     is_setup = false;
     ismaster = 0;
+    pipeline = 0;
+    delta = 0;
+    memset(delta_prev, 0, sizeof(delta_prev));
+    digest = 0;
+    sample_n = 0;
+    sample_rerun = false;
+    sample_count = 0;
+    sample_good = 0;
+    sample_folded = 0;
+    sample_hash = 0;
+    spill_pc = 0;
+    compress_algo = COMM_COMPRESS_NONE;
+    napprentices = 1;
+    daemon_mode = 0;
+    spawn_cmd = NULL;
+    nspawned = 0;
+    tee_fn = NULL;
+    cache_dir = NULL;
+    tee_fd = -1;
+    trace_opts.format = -1;
+    trace_opts.codec = -1;
+    trace_opts.level = 0;
+    trace_opts.threads = 0;
+    trace_opts.layout = TRACE_LAYOUT_ROWS;
+    trace_sync = 0;
+    tee_res = RES_OK;
+    image_dir = ".";
+    image_name = NULL;
+    memset(&trace_meta, 0, sizeof(trace_meta));
+    header_pending = false;
 
     longopts = setup_options(&shortopts);
 
@@ -792,6 +2879,11 @@ int risu_main(int argc, char **argv)
         if (c == -1) {
             break;
         }
+        if (c == 0 || c >= FIRST_ARCH_OPT) {
+            /* Recorded in traces, if it is an architecture option */
+            trace_meta_add_arch_opt(&trace_meta, longopts[optidx].name,
+                                    optarg);
+        }
 
         switch (c) {
         case 0:
@@ -801,9 +2893,115 @@ int risu_main(int argc, char **argv)
             trace_fn = optarg;
             trace = true;
             break;
+        case 'P':
+            pipeline = 1;
+            break;
+        case 'D':
+            delta = 1;
+            break;
+        case 'G':
+            digest = 1;
+            break;
         case 'h':
             hostname = optarg;
             break;
+        case 's':
+            shm_path = optarg;
+            break;
+        case 'i':
+            image_dir = optarg;
+            break;
+        case 'e':
+            spawn_cmd = optarg;
+            break;
+        case 'f':
+            comm_fd_arg = optarg;
+            break;
+        case 'T':
+            tee_fn = optarg;
+            break;
+        case 'K':
+            cache_dir = optarg;
+            break;
+        case 'F':
+            if (strcmp(optarg, "stream") == 0) {
+                trace_opts.format = TRACE_FORMAT_STREAM;
+            } else if (strcmp(optarg, "indexed") == 0) {
+                trace_opts.format = TRACE_FORMAT_INDEXED;
+            } else {
+                fprintf(stderr, "Error: unknown trace format %s\n\n", optarg);
+                usage();
+                free(longopts);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'C':
+            for (trace_opts.codec = TRACE_CODEC_LZ4;
+                 trace_opts.codec > TRACE_CODEC_NONE; trace_opts.codec--) {
+                if (strcmp(optarg, trace_codec_name(trace_opts.codec)) == 0) {
+                    break;
+                }
+            }
+            if (trace_opts.codec == TRACE_CODEC_NONE
+                && strcmp(optarg, "none") != 0) {
+                fprintf(stderr, "Error: unknown trace codec %s\n\n", optarg);
+                usage();
+                free(longopts);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'L':
+            trace_opts.level = strtol(optarg, 0, 10);
+            break;
+        case 'W':
+            trace_opts.threads = strtol(optarg, 0, 10);
+            break;
+        case 'Y':
+            if (strcmp(optarg, "rows") == 0) {
+                trace_opts.layout = TRACE_LAYOUT_ROWS;
+            } else if (strcmp(optarg, "columns") == 0) {
+                trace_opts.layout = TRACE_LAYOUT_COLUMNS;
+            } else {
+                fprintf(stderr, "Error: unknown trace layout %s\n\n", optarg);
+                usage();
+                free(longopts);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'S':
+            sample_n = strtol(optarg, 0, 10);
+            if (sample_n < 1) {
+                fprintf(stderr, "Error: --sample must be at least 1\n\n");
+                usage();
+                free(longopts);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            napprentices = strtol(optarg, 0, 10);
+            if (napprentices < 1 || napprentices > MAX_APPRENTICES) {
+                fprintf(stderr, "Error: --apprentices must be between 1 "
+                        "and %d\n\n", MAX_APPRENTICES);
+                usage();
+                free(longopts);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'z':
+            for (compress_algo = COMM_COMPRESS_ZSTD;
+                 compress_algo > COMM_COMPRESS_NONE; compress_algo--) {
+                if (strcmp(optarg, comm_compress_name(compress_algo)) == 0) {
+                    break;
+                }
+            }
+            if (compress_algo == COMM_COMPRESS_NONE
+                && strcmp(optarg, "none") != 0) {
+                fprintf(stderr, "Error: unknown compression %s\n\n", optarg);
+                usage();
+                free(longopts);
+                return EXIT_FAILURE;
+            }
+            break;
         case 'p':
             /* FIXME err handling */
             port = strtol(optarg, 0, 10);
@@ -819,6 +3017,145 @@ int risu_main(int argc, char **argv)
         }
     }
 
+    if (spawn_cmd && (!ismaster || trace || daemon_mode
+                      || (shm_path && napprentices > 1))) {
+        fprintf(stderr, "Error: --spawn is for a live master, and only one "
+                "apprentice can share memory\n\n");
+        usage();
+        free(longopts);
+        return EXIT_FAILURE;
+    }
+
+    if (tee_fn && (!ismaster || trace || daemon_mode)) {
+        fprintf(stderr, "Error: --tee is for a live master serving one "
+                "image\n\n");
+        usage();
+        free(longopts);
+        return EXIT_FAILURE;
+    }
+
+    if (cache_dir && (!ismaster || daemon_mode || !(trace || tee_fn)
+                      || (trace && strcmp(trace_fn, "-") == 0))) {
+        fprintf(stderr, "Error: --trace-cache is for a master recording a "
+                "trace file with -t or --tee\n\n");
+        usage();
+        free(longopts);
+        return EXIT_FAILURE;
+    }
+
+#ifndef RISU_MACOS9
+    if (!ismaster && !trace && !shm_path) {
+        /* Started by a master with --spawn? */
+        if (!comm_fd_arg) {
+            comm_fd_arg = getenv("RISU_FD");
+        }
+        if (!comm_fd_arg) {
+            shm_path = getenv("RISU_SHM");
+        }
+    }
+#endif
+
+    nimages = argc - optind;
+    if (nimages > 1 && (trace || tee_fn || daemon_mode || spawn_cmd
+                        || comm_fd_arg || napprentices > 1 || sample_n)) {
+        /* (--sample would reload one image while the others run.) */
+        fprintf(stderr, "Error: several images are for live runs over TCP "
+                "or shared memory,\nwith one apprentice each and without "
+                "--sample\n\n");
+        usage();
+        free(longopts);
+        return EXIT_FAILURE;
+    }
+#ifndef RISU_HAVE_THREADS
+    if (nimages > 1) {
+        fprintf(stderr, "Error: this risu runs one image at a time\n\n");
+        usage();
+        free(longopts);
+        return EXIT_FAILURE;
+    }
+#endif
+
+    if (daemon_mode && (!ismaster || trace || shm_path || napprentices > 1)) {
+        fprintf(stderr, "Error: --daemon is for a master talking TCP to one "
+                "apprentice per session\n\n");
+        usage();
+        free(longopts);
+        return EXIT_FAILURE;
+    }
+
+    if (napprentices > 1 && (!ismaster || trace || shm_path || digest)) {
+        fprintf(stderr, "Error: --apprentices is for a master talking TCP, "
+                "without --digest\n\n");
+        usage();
+        free(longopts);
+        return EXIT_FAILURE;
+    }
+
+    if (digest && (trace || pipeline)) {
+        /* The master has to be there to send the registers on request. */
+        fprintf(stderr, "Error: --digest can't be used with --pipeline "
+                "or a trace file\n\n");
+        usage();
+        free(longopts);
+        return EXIT_FAILURE;
+    }
+
+    if (sample_n && (trace || tee_fn || pipeline || digest || daemon_mode
+                     || napprentices > 1)) {
+        /* Both ends have to be there to start the image again. */
+        fprintf(stderr, "Error: --sample is for a live run with one "
+                "apprentice, without --pipeline,\n--digest or --tee\n\n");
+        usage();
+        free(longopts);
+        return EXIT_FAILURE;
+    }
+#ifdef RISU_DPPC
+    if (sample_n) {
+        /* The image is copied into the emulator just the once. */
+        fprintf(stderr, "Error: --sample can't start the image again "
+                "under DingusPPC\n\n");
+        usage();
+        free(longopts);
+        return EXIT_FAILURE;
+    }
+#endif
+
+#ifdef RISU_HAVE_THREADS
+    if (nimages > 1) {
+        int result = run_jobs(argv + optind, nimages, hostname, port,
+                              shm_path);
+
+        free(longopts);
+        return result;
+    }
+#endif
+
+    /* The daemon gets its images from the apprentices' sessions. */
+    if (!daemon_mode) {
+        imgfile = argv[optind];
+        if (!imgfile) {
+            fprintf(stderr, "Error: must specify image file name\n\n");
+            usage();
+            free(longopts);
+            return EXIT_FAILURE;
+        }
+
+        load_image(imgfile);
+        image_name = imgfile;
+    }
+
+#ifndef RISU_MACOS9
+    if (cache_dir && cache_fetch(trace ? trace_fn : tee_fn)) {
+        if (trace) {
+            unload_image();
+            free(longopts);
+            return EXIT_SUCCESS;
+        }
+        /* Just the live run then. */
+        tee_fn = NULL;
+    }
+#endif
+
     if (trace) {
         if (trace_fn && strcmp(trace_fn, "-") == 0) {
 #ifdef RISU_MACOS9
@@ -839,9 +3176,32 @@ int risu_main(int argc, char **argv)
                 perror("open");
                 exit(EXIT_FAILURE);
             }
-#ifdef HAVE_ZLIB
-            gz_trace_file = gzdopen(comm_fd, ismaster ? "wb9" : "rb");
-#endif
+        }
+        /* Leave a piped trace to an external compressor. */
+        if (trace_opts.format < 0) {
+            trace_opts.format = comm_fd == STDOUT_FILENO
+                                ? TRACE_FORMAT_STREAM : TRACE_FORMAT_INDEXED;
+        }
+        if (trace_opts.codec < 0 && comm_fd == STDOUT_FILENO) {
+            trace_opts.codec = TRACE_CODEC_NONE;
+        }
+        trace_opts.async = !trace_sync;
+        trace_file = ismaster ? trace_open_write(comm_fd, &trace_opts)
+                              : trace_open_read(comm_fd);
+        if (!trace_file) {
+            fprintf(stderr, "trace file \"%s\" cannot be %s\n", trace_fn,
+                    ismaster ? "written" : "read");
+            exit(EXIT_FAILURE);
+        }
+        if (ismaster) {
+            if (write_trace_meta(trace_file,
+                                 delta ? TRACE_META_DELTA : 0) != RES_OK) {
+                fprintf(stderr, "trace file \"%s\" cannot be written\n",
+                        trace_fn);
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            read_trace_meta();
         }
     } else {
 #ifdef RISU_MACOS9
@@ -849,41 +3209,44 @@ int risu_main(int argc, char **argv)
         perror("trace");
         exit(EXIT_FAILURE);
 #else
-        if (ismaster) {
+        if (tee_fn) {
+            /* Before connecting, so the writer holds no connections. */
+            tee_open();
+        }
+        if (spawn_cmd) {
+            spawn_apprentices(shm_path);
+        } else if (comm_fd_arg) {
+            comm_fd = strtol(comm_fd_arg, 0, 10);
+            fprintf(stderr, "apprentice fd %d\n", comm_fd);
+        } else if (shm_path) {
+            fprintf(stderr, "%s shared memory %s\n",
+                    ismaster ? "master" : "apprentice", shm_path);
+            comm_fd = ismaster ? shm_master_connect(shm_path)
+                               : shm_apprentice_connect(shm_path);
+        } else if (ismaster && daemon_mode) {
+            comm_fd = run_daemon(port);
+        } else if (ismaster && napprentices > 1) {
+            connect_apprentices(port);
+        } else if (ismaster) {
             fprintf(stderr, "master port %d\n", port);
             comm_fd = master_connect(port);
+            if (pipeline) {
+                /* A hang up mid-stream is reported by the apprentice. */
+                signal(SIGPIPE, SIG_IGN);
+            }
         } else {
             fprintf(stderr, "apprentice host %s port %d\n", hostname, port);
             comm_fd = apprentice_connect(hostname, port);
         }
+        if (napprentices <= 1 && !(spawn_cmd && !shm_path)) {
+            session_hello(comm_fd);
+        }
+        session_start();
 #endif
     }
 
-    imgfile = argv[optind];
-    if (!imgfile) {
-        fprintf(stderr, "Error: must specify image file name\n\n");
-        usage();
-        free(longopts);
-        return EXIT_FAILURE;
-    }
-
-    load_image(imgfile);
-
 #ifndef NO_SIGNAL
-    stack_t ss;
-
-    /* create alternate stack */
-    ss.ss_sp = malloc(SIGSTKSZ);
-    if (ss.ss_sp == NULL) {
-        perror("malloc");
-        exit(EXIT_FAILURE);
-    }
-    ss.ss_size = SIGSTKSZ;
-    ss.ss_flags = 0;
-    if (sigaltstack(&ss, NULL) == -1) {
-        perror("sigaltstac");
-        exit(EXIT_FAILURE);
-    }
+    set_alt_stack();
 #endif
 
     /* E.g. select requested SVE vector length. */
@@ -898,6 +3261,23 @@ int risu_main(int argc, char **argv)
         result = apprentice();
     }
 
+#ifndef RISU_MACOS9
+    /* The trace is complete if the master got to the end. */
+    bool recorded = ismaster && result == EXIT_SUCCESS;
+
+    /* With --spawn, the apprentices' verdict is ours too. */
+    if (nspawned && !wait_spawned()) {
+        result = EXIT_FAILURE;
+    }
+    if (tee_fn && !tee_close()) {
+        result = EXIT_FAILURE;
+        recorded = false;
+    }
+    if (cache_dir && recorded && (trace || tee_fn)) {
+        cache_store(trace ? trace_fn : tee_fn);
+    }
+#endif
+
     unload_image();
 
     free(longopts);
@@ -62,20 +62,37 @@ extern "C" {
 typedef void entrypoint_fn(void);
 typedef void (sig_handler_fn) (int, arch_siginfo_t *si, void *);
 
-extern uintptr_t image_start_address;
-extern entrypoint_fn *image_start;
-extern size_t image_size;
+/* The state of a run. Where there are threads each has its own, so
+ * that one process can run several images at once, a thread for each.
+ */
+#if defined(HAVE_PTHREAD) && !defined(RISU_DPPC)
+#define RISU_HAVE_THREADS
+#define RISU_TLS __thread
+#else
+#define RISU_TLS
+#endif
+
+extern RISU_TLS uintptr_t image_start_address;
+extern RISU_TLS entrypoint_fn *image_start;
+extern RISU_TLS size_t image_size;
 extern sig_handler_fn *sig_handler;
-extern size_t signal_count;
-extern size_t illegal_instructions;
+extern RISU_TLS size_t signal_count;
+extern RISU_TLS size_t illegal_instructions;
 void do_image();
 int risu_main(int argc, char **argv);
+int spawn_apprentice(const char *cmd, const char *shm_path, int *pid);
 
 /* Ops code under test can request from risu: */
 typedef enum {
     /* Any other sigill besides the destignated undefined insn.  */
     OP_SIGILL = -1,
 
+    /* Describes a trace (the first record of one); never generated. */
+    OP_METADATA = -2,
+
+    /* Checks the checkpoints --sample skipped; never generated. */
+    OP_SAMPLE = -3,
+
     /* These are generated by the designated undefined insn. */
     OP_COMPARE = 0,
     OP_TESTEND = 1,
@@ -84,6 +101,7 @@ typedef enum {
     OP_COMPAREMEM = 4,
     OP_SETUPBEGIN = 5,
     OP_SETUPEND = 6,
+    OP_COMPARESPILL = 7,
 } RisuOp;
 
 /* Result of operation */
@@ -101,6 +119,9 @@ typedef enum {
     RES_BAD_SIZE_ZERO,
     RES_BAD_OP,
     RES_SIGBUS,
+    RES_RESEND,
+    RES_BAD_IMAGE,
+    RES_RERUN,
 } RisuResult;
 
 /* The memory block should be this long */
@@ -124,10 +145,139 @@ typedef struct {
 
 /* Socket related routines */
 int master_connect(int port);
+int master_listen(int port, int backlog);
+int master_accept(int sock);
 int apprentice_connect(const char *hostname, int port);
+int shm_master_connect(const char *path);
+int shm_master_create(const char *path);
+void shm_master_wait(const char *path);
+int shm_apprentice_connect(const char *path);
 RisuResult send_data_pkt(int sock, void *pkt, int pktlen);
+RisuResult send_data_pkt_nowait(int sock, void *pkt, int pktlen);
+void send_data_pkt_all(int *socks, RisuResult *res, int n,
+                       void *pkt, int pktlen, bool nowait);
 RisuResult recv_data_pkt(int sock, void *pkt, int pktlen);
 void send_response_byte(int sock, int resp);
+RisuResult recv_response_byte(int sock);
+void recv_response_all(int *socks, RisuResult *res, int n);
+
+/* Wire compression, negotiated in the session handshake */
+enum {
+    COMM_COMPRESS_NONE,
+    COMM_COMPRESS_LZ4,
+    COMM_COMPRESS_ZSTD,
+};
+int comm_compress_supported(void);
+const char *comm_compress_name(int algo);
+int comm_set_compression(int algo);
+
+/* Trace files (trace.c) */
+enum {
+    TRACE_FORMAT_STREAM,    /* one compressed stream, read sequentially */
+    TRACE_FORMAT_INDEXED,   /* separately compressed frames and an index */
+};
+
+/* How indexed trace frames hold the records */
+enum {
+    TRACE_LAYOUT_ROWS,      /* as they were written */
+    TRACE_LAYOUT_COLUMNS,   /* a column per word, XOR delta coded */
+};
+
+/* Trace compression; the numbers are stored in indexed trace files */
+enum {
+    TRACE_CODEC_NONE,
+    TRACE_CODEC_GZIP,
+    TRACE_CODEC_ZSTD,
+    TRACE_CODEC_LZ4,
+};
+
+typedef struct {
+    int format;         /* TRACE_FORMAT_* */
+    int codec;          /* TRACE_CODEC_*, or -1 for trace_codec_default() */
+    int level;          /* compression level, 0 for the codec's default */
+    int threads;        /* compression worker threads (zstd), 0 for none */
+    int layout;         /* TRACE_LAYOUT_*, indexed format only */
+    bool async;         /* compress and write on a thread of its own */
+} trace_opts_t;
+
+/* Index entry for a frame of an indexed trace */
+typedef struct {
+    uint64_t offset;    /* in the file */
+    uint64_t first;     /* first checkpoint (record number) */
+    uint32_t records;   /* number of checkpoints */
+    uint32_t min_pc;    /* range of image offsets they were taken at */
+    uint32_t max_pc;
+    uint32_t raw_len;   /* uncompressed size */
+    uint64_t chain;     /* anchor: hash of the records up to its end */
+    bool setup;         /* its first checkpoint is in setup code */
+} trace_frame_t;
+
+typedef struct trace_file trace_file_t;
+
+int trace_codec_supported(void);
+int trace_codec_default(void);
+const char *trace_codec_name(int codec);
+trace_file_t *trace_open_write(int fd, const trace_opts_t *opts);
+trace_file_t *trace_open_read(int fd);
+RisuResult trace_mark(trace_file_t *t, uint32_t image_offset, bool setup);
+RisuResult trace_write(trace_file_t *t, const void *ptr, size_t bytes);
+RisuResult trace_read(trace_file_t *t, void *ptr, size_t bytes);
+void *trace_view(trace_file_t *t, size_t bytes, size_t align);
+RisuResult trace_close(trace_file_t *t);
+int trace_format(trace_file_t *t);
+int trace_codec(trace_file_t *t);
+int trace_frames(trace_file_t *t);
+const trace_frame_t *trace_frame(trace_file_t *t, int i);
+bool trace_chained(trace_file_t *t);
+bool trace_setup_known(trace_file_t *t);
+int trace_find_checkpoint(trace_file_t *t, uint64_t n);
+int trace_find_offset(trace_file_t *t, uint32_t image_offset, int frame);
+RisuResult trace_seek_frame(trace_file_t *t, int frame);
+
+/* Trace metadata: the payload of the OP_METADATA record that starts
+ * a trace, saying what recorded it. Stored big endian.
+ */
+#define TRACE_META_VERSION   1
+#define TRACE_META_NAME_LEN  256
+#define TRACE_META_OPTS_LEN  512
+
+/* trace_meta_t.options */
+#define TRACE_META_DELTA     (1 << 0)   /* records are --delta coded */
+
+typedef struct {
+    uint32_t version;
+    uint32_t big_endian;    /* get_arch_big_endian() */
+    uint32_t reginfo_size;  /* sizeof(struct reginfo) */
+    uint32_t memblock_len;  /* MEMBLOCKLEN */
+    uint32_t options;       /* TRACE_META_* */
+    uint32_t image_hash[2]; /* risu_hash64() of the image, high word first */
+    char image_name[TRACE_META_NAME_LEN];
+    char arch_opts[TRACE_META_OPTS_LEN];    /* as "--name=value ..." */
+} trace_meta_t;
+
+void trace_meta_swap(trace_meta_t *m);
+bool trace_meta_check(trace_meta_t *m);
+void trace_meta_add_arch_opt(trace_meta_t *m, const char *name,
+                             const char *arg);
+bool trace_meta_apply_arch_opts(const trace_meta_t *m);
+
+/* Offline trace tools (tracetool.c) */
+typedef struct {
+    trace_file_t *t;
+    trace_header_t header;  /* in host byte order */
+    struct reginfo *ri;     /* for OP_COMPARE, OP_TESTEND and OP_SIGILL */
+    uint8_t *mem;           /* for OP_COMPAREMEM */
+    struct reginfo ri_buf;
+    uint8_t mem_buf[MEMBLOCKLEN];
+    trace_meta_t meta;      /* in host byte order, if has_meta */
+    bool has_meta;
+    bool pending;           /* header was read ahead, and is next */
+} trace_record_t;
+
+bool tool_open_trace(trace_record_t *r, const char *fn);
+RisuResult tool_read_record(trace_record_t *r);
+const char *tool_op_name(int op);
+struct option *tool_options(const struct option *opts);
 
 /* Functions operating on reginfo */
 
@@ -159,6 +309,17 @@ arch_ptr_t get_pc(struct reginfo *ri);
 /* initialize structure from a ucontext */
 void reginfo_init(struct reginfo *ri, void *uc, void *siaddr);
 
+#ifdef RISU_HAVE_SPILL
+/* initialize structure from a checkpoint the image spilled to its ring
+ * (risugen --spill), and return the address it was taken at */
+arch_ptr_t reginfo_init_spill(struct reginfo *ri, struct spillinfo *si);
+
+/* update a ucontext at the OP_COMPARESPILL trap from the ring's last
+ * slot, with what the slots hold */
+void reginfo_update_spill(struct reginfo *ri, struct spillinfo *si,
+                          void *uc);
+#endif
+
 /* update a ucontext */
 void reginfo_update(struct reginfo *ri, void *uc, void *siaddr);
 
@@ -0,0 +1,64 @@
+/*******************************************************************************
+ * Copyright (c) 2026 risu contributors
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ ******************************************************************************/
+
+#ifndef RISU_HASH_H
+#define RISU_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A small non-cryptographic 64-bit hash (the single lane variant of
+ * XXH64). Input words are assembled byte by byte so the result does
+ * not depend on the host byte order: master and apprentice get the
+ * same value for the same bytes.
+ */
+
+#define RISU_HASH_P1 0x9E3779B185EBCA87ULL
+#define RISU_HASH_P2 0xC2B2AE3D27D4EB4FULL
+#define RISU_HASH_P3 0x165667B19E3779F9ULL
+#define RISU_HASH_P4 0x85EBCA77C2B2AE63ULL
+#define RISU_HASH_P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t risu_hash_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t risu_hash_load64(const uint8_t *p)
+{
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) |
+           ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+           ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+           ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static inline uint64_t risu_hash64(const void *buf, size_t len, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    uint64_t h = seed + RISU_HASH_P5 + (uint64_t)len;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t k = risu_hash_load64(p) * RISU_HASH_P2;
+        h ^= risu_hash_rotl(k, 31) * RISU_HASH_P1;
+        h = risu_hash_rotl(h, 27) * RISU_HASH_P1 + RISU_HASH_P4;
+    }
+    for (; len; p++, len--) {
+        h ^= *p * RISU_HASH_P5;
+        h = risu_hash_rotl(h, 11) * RISU_HASH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= RISU_HASH_P2;
+    h ^= h >> 29;
+    h *= RISU_HASH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+#endif /* RISU_HASH_H */
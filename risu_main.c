@@ -20,6 +20,10 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <Memory.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
 #endif
 
 char * argcargv(char ***dargv, int *dargc, char *buf)
@@ -121,6 +125,69 @@ donewords:
     return s;
 }
 
+#ifndef RISU_MACOS9
+/* Fork and exec the apprentice command line cmd (split into words the
+ * same way as the MacOS 9 command line, no shell involved). It gets
+ * one end of a socketpair, whose fd number it finds in $RISU_FD, and
+ * we return the other. With shm_path it is pointed at that shared
+ * memory channel through $RISU_SHM instead, and we return -1.
+ */
+int spawn_apprentice(const char *cmd, const char *shm_path, int *pid)
+{
+    int sv[2] = { -1, -1 };
+    char *buf = strdup(cmd);
+    char **words, **argv;
+    int argc, i;
+
+    argcargv(&words, &argc, buf);
+    if (argc == 0) {
+        fprintf(stderr, "Error: empty apprentice command\n");
+        exit(EXIT_FAILURE);
+    }
+    argv = (char **)calloc(argc + 1, sizeof(char *));
+    for (i = 0; i < argc; i++) {
+        argv[i] = words[i];
+    }
+
+    if (!shm_path) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+            perror("socketpair");
+            exit(EXIT_FAILURE);
+        }
+        fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+    }
+
+    *pid = fork();
+    if (*pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (*pid == 0) {
+        char fdstr[16];
+
+        if (shm_path) {
+            setenv("RISU_SHM", shm_path, 1);
+        } else {
+            sprintf(fdstr, "%d", sv[1]);
+            setenv("RISU_FD", fdstr, 1);
+        }
+        execvp(argv[0], argv);
+        fprintf(stderr, "failed to run %s\n", argv[0]);
+        perror("execvp");
+        _exit(127);
+    }
+
+    free(argv);
+    free(words);
+    free(buf);
+    if (shm_path) {
+        return -1;
+    }
+    close(sv[1]);
+    return sv[0];
+}
+#endif
+
 #ifdef RISU_MACOS9
 char gbuf[30000];
 
@@ -263,6 +263,19 @@ static void savevec(void *vrregs, void *vscr, void *vrsave)
 }
 #endif
 
+/* The instructions around pc, and where it is in the image */
+static void reginfo_init_insns(struct reginfo *ri, arch_ptr_t pc)
+{
+    arch_ptr_t ibegin = get_arch_start_address();
+    arch_ptr_t iend = (arch_ptr_t)(get_arch_start_address() + image_size);
+    uint8_t * pc_ptr = (uint8_t *)get_arch_memory(pc);
+    ri->second_prev_insn = arch_to_host_32((pc - 8) >= ibegin && (pc - 8) < iend ? *((uint32_t *) (pc_ptr - 8)) : 0);
+    ri->prev_insn        = arch_to_host_32((pc - 4) >= ibegin && (pc - 4) < iend ? *((uint32_t *) (pc_ptr - 4)) : 0);
+    ri->faulting_insn    = arch_to_host_32((pc + 0) >= ibegin && (pc + 0) < iend ? *((uint32_t *) (pc_ptr + 0)) : 0);
+    ri->next_insn        = arch_to_host_32((pc + 4) >= ibegin && (pc + 4) < iend ? *((uint32_t *) (pc_ptr + 4)) : 0);
+    ri->nip = (uint32_t)(pc - ibegin);
+}
+
 /* reginfo_init: initialize with a ucontext */
 void reginfo_init(struct reginfo *ri, void *vuc, void *siaddr)
 {
@@ -279,14 +292,7 @@ void reginfo_init(struct reginfo *ri, void *vuc, void *siaddr)
     memset(ri, 0, sizeof(*ri));
 
     arch_ptr_t pc = get_uc_pc(uc, siaddr);
-    arch_ptr_t ibegin = get_arch_start_address();
-    arch_ptr_t iend = (arch_ptr_t)(get_arch_start_address() + image_size);
-    uint8_t * pc_ptr = (uint8_t *)get_arch_memory(pc);
-    ri->second_prev_insn = arch_to_host_32((pc - 8) >= ibegin && (pc - 8) < iend ? *((uint32_t *) (pc_ptr - 8)) : 0);
-    ri->prev_insn        = arch_to_host_32((pc - 4) >= ibegin && (pc - 4) < iend ? *((uint32_t *) (pc_ptr - 4)) : 0);
-    ri->faulting_insn    = arch_to_host_32((pc + 0) >= ibegin && (pc + 0) < iend ? *((uint32_t *) (pc_ptr + 0)) : 0);
-    ri->next_insn        = arch_to_host_32((pc + 4) >= ibegin && (pc + 4) < iend ? *((uint32_t *) (pc_ptr + 4)) : 0);
-    ri->nip = (uint32_t)(pc - ibegin);
+    reginfo_init_insns(ri, pc);
 
 #if defined(RISU_DPPC)
     for (i = 0; i < 32; i++) {
@@ -392,33 +398,96 @@ void reginfo_init(struct reginfo *ri, void *vuc, void *siaddr)
 #endif
 }
 
-/* reginfo_update: update the context */
-void reginfo_update(struct reginfo *ri, void *vuc, void *siaddr)
+/* A register as the image spilled it: with the ring's width (which
+ * risu checked is RISU_SPILL_WIDTH), a doubleword or its first word.
+ */
+static reg_t get_spilled(const uint32_t *w)
+{
+    if (sizeof(reg_t) == 8) {
+        int hi = get_arch_big_endian() ? 0 : 1;
+        return (uint64_t)arch_to_host_32(w[hi]) << 32
+               | arch_to_host_32(w[1 - hi]);
+    }
+    return arch_to_host_32(w[0]);
+}
+
+static void put_spilled(uint32_t *w, reg_t val)
+{
+    if (sizeof(reg_t) == 8) {
+        int hi = get_arch_big_endian() ? 0 : 1;
+        w[hi] = arch_to_host_32((uint32_t)((uint64_t)val >> 32));
+        w[1 - hi] = arch_to_host_32((uint32_t)val);
+    } else {
+        w[0] = arch_to_host_32((uint32_t)val);
+    }
+}
+
+/* reginfo_init_spill: initialize from a checkpoint the image spilled */
+arch_ptr_t reginfo_init_spill(struct reginfo *ri, struct spillinfo *si)
+{
+    /* The words of a doubleword, high one first in a big endian image */
+    int hi = get_arch_big_endian() ? 0 : 1;
+    int i;
+
+    memset(ri, 0, sizeof(*ri));
+
+    arch_ptr_t pc = get_arch_start_address() + arch_to_host_32(si->pc);
+    reginfo_init_insns(ri, pc);
+
+    for (i = 0; i < 32; i++) {
+        ri->gregs[i] = get_spilled(si->gregs[i]);
+    }
+    /* The image can't read MSR, MQ (but on a 601), DAR or DSISR. */
+    ri->gregs[risu_NIP  ] = pc;
+    ri->gregs[risu_CTR  ] = get_spilled(si->ctr);
+    ri->gregs[risu_LNK  ] = get_spilled(si->lnk);
+    ri->gregs[risu_XER  ] = arch_to_host_32(si->xer);
+    ri->gregs[risu_CCR  ] = arch_to_host_32(si->ccr);
+
+    for (i = 0; i < 32; i++) {
+        ri->fpregs[i] = (uint64_t)arch_to_host_32(si->fpregs[i][hi]) << 32
+                        | arch_to_host_32(si->fpregs[i][1 - hi]);
+    }
+    ri->fpscr = arch_to_host_32(si->fpscr[1 - hi]);
+    return pc;
+}
+
+/* Update the context; when spilled, only with what a spill slot holds
+ * (not MQ or the vector registers), and not r0, which holds the ring.
+ */
+static void update_context(struct reginfo *ri, void *vuc, bool spilled)
 {
-    #pragma unused(siaddr)
 #if defined(RISU_DPPC)
     ppc_state.cr = ri->gregs[risu_CCR];
     ppc_state.spr[SPR::XER] = ri->gregs[risu_XER];
-    ppc_state.spr[SPR::MQ] = ri->gregs[risu_MQ];
+    if (!spilled) {
+        ppc_state.spr[SPR::MQ] = ri->gregs[risu_MQ];
+    }
 #elif defined(RISU_MACOS9)
     ExceptionInformation *uc = (ExceptionInformation *) vuc;
     uc->machineState->CR = ri->gregs[risu_CCR];
     uc->machineState->XER = ri->gregs[risu_XER];
-    uc->machineState->MQ = ri->gregs[risu_MQ];
+    if (!spilled) {
+        uc->machineState->MQ = ri->gregs[risu_MQ];
+    }
 #elif defined(__APPLE__)
     ucontext_t *uc = (ucontext_t *)vuc;
     uc->uc_mcontext->ss.cr = ri->gregs[risu_CCR];
     uc->uc_mcontext->ss.xer = ri->gregs[risu_XER];
-    uc->uc_mcontext->ss.mq = ri->gregs[risu_MQ];
+    if (!spilled) {
+        uc->uc_mcontext->ss.mq = ri->gregs[risu_MQ];
+    }
 #else
     ucontext_t *uc = (ucontext_t *)vuc;
     uc->uc_mcontext.gp_regs[CR] = ri->gregs[risu_CCR];
     uc->uc_mcontext.gp_regs[XER] = ri->gregs[risu_XER];
-    uc->uc_mcontext.gp_regs[MQ] = ri->gregs[risu_MQ];
+    if (!spilled) {
+        uc->uc_mcontext.gp_regs[MQ] = ri->gregs[risu_MQ];
+    }
 #endif
 
     int i;
-    for (i = 0; i < 32; i++) {
+    for (i = spilled ? 1 : 0; i < 32; i++) {
         if ((1 << (31-i)) & ~gregs_mask) {
             continue;
         }
@@ -451,17 +520,39 @@ void reginfo_update(struct reginfo *ri, void *vuc, void *siaddr)
 #endif
 
 #ifdef VRREGS
+    if (!spilled) {
 #if defined(RISU_DPPC)
 #elif defined(RISU_MACOS9)
 #elif defined(__APPLE__)
-    memcpy(uc->uc_mcontext->vs.save_vscr, ri->vrregs.vscr,
-           sizeof(ri->vrregs.vscr[0]) * 4);
+        memcpy(uc->uc_mcontext->vs.save_vscr, ri->vrregs.vscr,
+               sizeof(ri->vrregs.vscr[0]) * 4);
 #else
-    uc->uc_mcontext.v_regs->vscr = ri->vrregs.vscr;
+        uc->uc_mcontext.v_regs->vscr = ri->vrregs.vscr;
 #endif
+    }
 #endif
 }
 
+/* reginfo_update: update the context */
+void reginfo_update(struct reginfo *ri, void *vuc, void *siaddr)
+{
+    #pragma unused(siaddr)
+    update_context(ri, vuc, false);
+}
+
+/* reginfo_update_spill: update the context at an OP_COMPARESPILL trap
+ * from the last slot of the ring, and r0 in that slot, which the image
+ * reloads r0 from.
+ */
+void reginfo_update_spill(struct reginfo *ri, struct spillinfo *si,
+                          void *vuc)
+{
+    update_context(ri, vuc, true);
+    if (gregs_mask & (1 << 31)) {
+        put_spilled(si->gregs[0], ri->gregs[0]);
+    }
+}
+
 bool denormalized(uint64_t n) {
     return (((n >> 52) & 0x7ff) == 0) && ((n & ~(1LL<<63)) != 0); // exponent is zero and mantissa is not zero
 }
@@ -74,4 +74,25 @@ struct reginfo {
 #endif
 };
 
+/* A checkpoint an image generated with risugen --spill stored to its
+ * ring, as it stored it: 32-bit words in the image's byte order. The
+ * registers that are wider on a 64-bit host get a doubleword each, in
+ * memory order; an image generated without --spill64 only stores the
+ * first word of those.
+ */
+struct spillinfo {
+    uint32_t pc;            /* image offset of the store sequence */
+    uint32_t ccr;
+    uint32_t xer;
+    uint32_t pad;
+    uint32_t ctr[2];
+    uint32_t lnk[2];
+    uint32_t gregs[32][2];
+    uint32_t fpregs[32][2]; /* doublewords, in memory order */
+    uint32_t fpscr[2];      /* as stored by mffs */
+};
+
+#define RISU_HAVE_SPILL
+#define RISU_SPILL_WIDTH sizeof(reg_t)
+
 #endif /* RISU_REGINFO_PPC64_H */
@@ -41,6 +41,7 @@ BEGIN {
         $OP_COMPAREMEM
         $OP_SETUPBEGIN
         $OP_SETUPEND
+        $OP_COMPARESPILL
     );
 }
 
@@ -51,6 +52,7 @@ our $OP_GETMEMBLOCK = 3;    # get the address of memory block
 our $OP_COMPAREMEM = 4;     # compare memory block
 our $OP_SETUPBEGIN = 5;     # setup instructions are going to be executed
 our $OP_SETUPEND = 6;       # no more setup instructions
+our $OP_COMPARESPILL = 7;   # compare the registers spilled to the ring
 
 our $bytecount;
 
@@ -89,6 +89,62 @@ sub write_subf_r($$$)
     insn32((31 << 26) | ($rt << 21) | ($ra << 16) | ($rb << 11) | (40 << 1));
 }
 
+sub write_stw_r1($$)
+{
+    my ($rs, $imm) = @_;
+
+    # stw rs, imm(r1)
+    insn32((0x24 << 26) | ($rs << 21) | (1 << 16) | ($imm & 0xffff));
+}
+
+sub write_lwz_r1($$)
+{
+    my ($rt, $imm) = @_;
+
+    # lwz rt, imm(r1)
+    insn32((0x20 << 26) | ($rt << 21) | (1 << 16) | ($imm & 0xffff));
+}
+
+sub write_std_r1($$)
+{
+    my ($rs, $imm) = @_;
+
+    # std rs, imm(r1)
+    insn32((0x3e << 26) | ($rs << 21) | (1 << 16) | ($imm & 0xfffc));
+}
+
+sub write_ld_r1($$)
+{
+    my ($rt, $imm) = @_;
+
+    # ld rt, imm(r1)
+    insn32((0x3a << 26) | ($rt << 21) | (1 << 16) | ($imm & 0xfffc));
+}
+
+sub write_stfd_r1($$)
+{
+    my ($frs, $imm) = @_;
+
+    # stfd frs, imm(r1)
+    insn32((0x36 << 26) | ($frs << 21) | (1 << 16) | ($imm & 0xffff));
+}
+
+sub write_lfd_r1($$)
+{
+    my ($frt, $imm) = @_;
+
+    # lfd frt, imm(r1)
+    insn32((0x32 << 26) | ($frt << 21) | (1 << 16) | ($imm & 0xffff));
+}
+
+sub write_mfspr($$)
+{
+    my ($rt, $spr) = @_;
+
+    # mfspr rt, spr
+    insn32((31 << 26) | ($rt << 21) | (($spr & 31) << 16) | (($spr >> 5) << 11) | (339 << 1));
+}
+
 sub write_mov_ri($$)
 {
     my ($rd, $imm) = @_;
@@ -550,13 +606,116 @@ sub gen_one_insn($$)
     }
 }
 
+# Spilled compares (--spill n): instead of trapping, store the registers
+# to the next of n slots of a ring above r1, and trap with OP_COMPARESPILL
+# once the ring is full or before any other risu op. With r0 pointing at
+# it, the ring holds a slot count, the size of the GPRs in the slots and
+# the slots, each laid out as struct spillinfo in risu_reginfo_ppc64.h.
+# It is well clear of the memory the load/store tests use.
+#
+# A slot has a doubleword for each GPR, CTR and LR. With --spill64 they
+# are stored and r0 reloaded in full, for 64-bit hosts, where a word
+# wouldn't do: reloading r0 with lwz would clear its high word. Without
+# it the image only uses word accesses, for 32-bit hosts.
+my $SPILL_RING = 0x1000;    # offset of the ring from r1
+my $SPILL_SLOT = 552;       # sizeof(struct spillinfo)
+my $SPILL_GREGS = 32;       # offsetof(struct spillinfo, gregs)
+my $SPILL_FPREGS = 288;     # offsetof(struct spillinfo, fpregs)
+my $spill_slots = 0;
+my $spill64 = 0;
+my $spilled = 0;            # slots in use
+
+sub write_spill_store($$)
+{
+    my ($rs, $imm) = @_;
+
+    if ($spill64) {
+        write_std_r1($rs, $imm);
+    } else {
+        write_stw_r1($rs, $imm);
+    }
+}
+
+sub write_spill_load($$)
+{
+    my ($rt, $imm) = @_;
+
+    if ($spill64) {
+        write_ld_r1($rt, $imm);
+    } else {
+        write_lwz_r1($rt, $imm);
+    }
+}
+
+sub write_spill_flush()
+{
+    my $last = $SPILL_RING + 8 + ($spilled - 1) * $SPILL_SLOT;
+
+    write_mov_ri(0, $spilled);
+    write_stw_r1(0, $SPILL_RING);
+    write_mov_ri(0, $spill64 ? 8 : 4);
+    write_stw_r1(0, $SPILL_RING + 4);
+    write_add_ri(0, 1, $SPILL_RING);
+    $spilled = 0;
+    write_risuop($OP_COMPARESPILL);
+    # r0 was the param register, restore it
+    write_spill_load(0, $last + $SPILL_GREGS);
+}
+
+sub write_spill()
+{
+    my $slot = $SPILL_RING + 8 + $spilled * $SPILL_SLOT;
+    my $pc = $bytecount;
+
+    # r0 is the scratch register once it has been stored
+    for (my $i = 0; $i < 32; $i++) {
+        write_spill_store($i, $slot + $SPILL_GREGS + $i * 8);
+    }
+    # mfcr r0
+    insn32((31 << 26) | (0 << 21) | (19 << 1));
+    write_stw_r1(0, $slot + 4);
+    write_mfspr(0, 1);                  # mfxer r0
+    write_stw_r1(0, $slot + 8);
+    write_mfspr(0, 9);                  # mfctr r0
+    write_spill_store(0, $slot + 16);
+    write_mfspr(0, 8);                  # mflr r0
+    write_spill_store(0, $slot + 24);
+    write_mov_ri(0, $pc);
+    write_stw_r1(0, $slot);
+    for (my $i = 0; $i < 32; $i++) {
+        write_stfd_r1($i, $slot + $SPILL_FPREGS + $i * 8);
+    }
+    # mffs f0 ; and f0 back again
+    insn32((63 << 26) | (0 << 21) | (583 << 1));
+    write_stfd_r1(0, $slot + $SPILL_FPREGS + 256);
+    write_lfd_r1(0, $slot + $SPILL_FPREGS);
+    write_spill_load(0, $slot + $SPILL_GREGS);
+
+    if (++$spilled == $spill_slots) {
+        write_spill_flush();
+    }
+}
+
 sub write_risuop($)
 {
     # instr with bits (28:27) == 0 0 are UNALLOCATED
     my ($op) = @_;
+    if ($spilled) {
+        # The spilled compares came first.
+        write_spill_flush();
+    }
     insn32(0x00005af0 | $op);
 }
 
+sub write_compare()
+{
+    if ($spill_slots) {
+        write_spill();
+    } else {
+        write_risuop($OP_COMPARE);
+    }
+}
+
 sub write_test_code($)
 {
     my ($params) = @_;
@@ -565,6 +724,8 @@ sub write_test_code($)
     my $numinsns = $params->{ 'numinsns' };
     my $fp_enabled = $params->{ 'fp_enabled' };
     my $outfile = $params->{ 'outfile' };
+    $spill_slots = $params->{ 'spill' };
+    $spill64 = $params->{ 'spill64' };
 
     my %insn_details = %{ $params->{ 'details' } };
     my @keys = @{ $params->{ 'keys' } };
@@ -596,21 +757,21 @@ sub write_test_code($)
 
     write_risuop($OP_SETUPEND);
 
-    write_risuop($OP_COMPARE);
+    write_compare();
 
     for my $i (1..$numinsns) {
         my $insn_enc = $keys[int rand (@keys)];
         #dump_insn_details($insn_enc, $insn_details{$insn_enc});
         my $forcecond = (rand() < $condprob) ? 1 : 0;
         gen_one_insn($forcecond, $insn_details{$insn_enc});
-        write_risuop($OP_COMPARE);
+        write_compare();
         # Rewrite the registers periodically. This avoids the tendency
         # for the VFP registers to decay to NaNs and zeroes.
         if ($periodic_reg_random && ($i % 100) == 0) {
             write_risuop($OP_SETUPBEGIN);
             write_random_register_data($fp_enabled);
             write_risuop($OP_SETUPEND);
-            write_risuop($OP_COMPARE);
+            write_compare();
         }
         progress_update($i);
     }
@@ -0,0 +1,2211 @@
+/******************************************************************************
+ * Copyright (c) 2026 risu contributors
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *****************************************************************************/
+
+/* Trace file reading and writing */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#ifndef RISU_MACOS9
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "risu.h"
+#include "risu_hash.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#include <lz4frame.h>
+#endif
+
+/*
+ * Two trace formats are understood.
+ *
+ * The stream format is what risu has always written: the trace_header_t
+ * and payload of each record back to back, either raw or as a single
+ * gzip, zstd or LZ4 (frame format) stream. Readers tell which from the
+ * first bytes.
+ *
+ * The indexed format cuts the same bytes into frames, always at a
+ * record boundary, and compresses each frame on its own so that a
+ * reader can start at any of them. A footer indexes the frames:
+ *
+ *   file header   'RTRC', version, codec, frame size
+ *   frame         'RFRM', raw length, stored length, records, data
+ *   ...
+ *   setup         'RSET', frame count, one byte per frame
+ *   chain         'RCHN', frame count, one 64-bit anchor per frame
+ *   index         one entry per frame (see trace_put_index())
+ *   trailer       'RIDX', frame count, index offset (64 bit)
+ *
+ * The codec is a TRACE_CODEC_*; gzip frames are in zlib format. A frame
+ * whose stored length equals its raw length is not compressed. All
+ * fields are big endian. Record n of a trace (counting from 0) is
+ * called checkpoint n here.
+ *
+ * Version 2 files have the frames in a columnar layout (see
+ * columns_encode()), with the length of that as the first word of the
+ * stored data and the rest compressed unless the codec is none.
+ *
+ * The anchor of a frame is a hash chained over the records of all the
+ * frames up to and including it (see trace_flush_frame()). Two traces
+ * whose anchors for a frame are the same hold the same records up to
+ * its end, so they can be compared without reading them. Readers that
+ * don't know about the chain stop at the first thing that isn't a
+ * frame, and find the index through the trailer.
+ *
+ * The setup byte of a frame says whether its first checkpoint is in
+ * setup code (between OP_SETUPBEGIN and OP_SETUPEND), which the writer
+ * is told with each mark, so that a comparison can start at any frame.
+ * Older traces have no setup bytes.
+ *
+ * Traces risu records start with an OP_METADATA record, whose payload
+ * is a trace_meta_t. It is written before the first mark, so it is not
+ * a checkpoint and doesn't show in the index.
+ */
+#define TRACE_MAGIC      ((uint32_t)(('R' << 24) | ('T' << 16) | ('R' << 8) | 'C'))
+#define TRACE_FRAME      ((uint32_t)(('R' << 24) | ('F' << 16) | ('R' << 8) | 'M'))
+#define TRACE_INDEX      ((uint32_t)(('R' << 24) | ('I' << 16) | ('D' << 8) | 'X'))
+#define TRACE_CHAIN      ((uint32_t)(('R' << 24) | ('C' << 16) | ('H' << 8) | 'N'))
+#define TRACE_SETUP      ((uint32_t)(('R' << 24) | ('S' << 16) | ('E' << 8) | 'T'))
+#define TRACE_VERSION    1
+#define TRACE_VERSION_COLUMNS 2
+
+#define TRACE_HEADER_LEN  16
+#define TRACE_FRAME_LEN   16
+#define TRACE_ENTRY_LEN   32
+#define TRACE_TRAILER_LEN 16
+
+/* Magic numbers of the compressed stream formats */
+#define GZIP_MAGIC  0x1f8b0000
+#define GZIP_MASK   0xffff0000
+#define ZSTD_MAGIC  0x28b52ffd
+#define LZ4F_MAGIC  0x04224d18
+
+/* Raw bytes per frame: small enough to seek finely, big enough to
+ * compress well.
+ */
+#define TRACE_FRAME_SIZE (256 * 1024)
+
+/* Size of the i/o buffer, and of the chunks a stream is encoded in */
+#define TRACE_IO_SIZE (64 * 1024)
+
+/* Size of the queue to the writer thread (a power of 2): a few hundred
+ * checkpoints with memory blocks, enough to ride out a slow frame.
+ */
+#define TRACE_QUEUE_SIZE (8 * 1024 * 1024)
+#define TRACE_QUEUE_MARK 0x80000000
+
+/* Wake the writer thread only once this much has been queued, rather
+ * than for every checkpoint.
+ */
+#define TRACE_QUEUE_BATCH (256 * 1024)
+
+struct trace_file {
+    int fd;
+    bool writing;
+    int format;
+    int codec;
+    int level;
+    int layout;
+    bool eof;           /* nothing more to read from fd */
+    bool done;          /* the compressed stream has ended */
+
+    /* Bytes read and not used yet, or encoded and not written yet.
+     * When a trace file is mapped, this is the whole file.
+     */
+    uint8_t *io;
+    size_t io_pos, io_len, io_cap;
+    bool mapped;
+
+    /* The current frame (indexed), or bytes waiting to be encoded */
+    uint8_t *frame;
+    size_t frame_len, frame_pos, frame_cap;
+    uint8_t *data;      /* frame contents: frame, or in the mapping */
+    uint8_t *stored;
+    size_t stored_cap;
+    uint8_t *cols;      /* the frame in columnar layout */
+    size_t cols_cap;
+    uint32_t *marks;    /* where the frame's records start */
+    uint32_t marks_cap;
+    uint32_t frame_records;
+    uint32_t frame_min_pc, frame_max_pc;
+    bool frame_setup;   /* its first record is in setup code */
+    int frame_no;
+
+    uint64_t records;   /* records before the current frame */
+    uint64_t offset;    /* file offset of the next frame */
+    uint64_t chain;     /* anchor of the last frame */
+    size_t chain_from;  /* start of the records in the frame */
+
+    trace_frame_t *index;
+    int nindex, index_cap;
+    bool chained;       /* the index has the frames' anchors */
+    bool setup_known;   /* and their setup bytes */
+
+#ifdef HAVE_PTHREAD
+    /* The queue to the writer thread, if there is one: each entry is a
+     * uint32_t tag, the length of the data for trace_write() or
+     * TRACE_QUEUE_MARK for trace_mark(), and then the data. From the
+     * readahead thread, it is just the trace_read() data.
+     */
+    bool async;
+    pthread_t thread;
+    uint8_t *queue;
+    uint8_t *entry;             /* the thread's copy of an entry */
+    uint32_t q_head;            /* consumer position */
+    uint32_t q_done;            /* the writer is done up to here */
+    uint32_t q_tail;            /* producer position */
+    uint32_t q_rd_wait;         /* consumer sleeps on q_tail */
+    uint32_t q_wr_wait;         /* producer sleeps on q_head */
+    uint32_t q_closing;         /* nothing more will be queued */
+    uint32_t q_stop;            /* stop reading ahead */
+    uint32_t q_res;             /* first error of the thread */
+#endif
+
+#ifdef HAVE_ZLIB
+    z_stream zs;
+    bool zs_live;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zc;
+    ZSTD_DCtx *zd;
+#endif
+#ifdef HAVE_LZ4
+    LZ4F_cctx *lc;
+    LZ4F_dctx *ld;
+#endif
+};
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
+
+/* Codecs */
+
+int trace_codec_supported(void)
+{
+    int mask = 1 << TRACE_CODEC_NONE;
+#ifdef HAVE_ZLIB
+    mask |= 1 << TRACE_CODEC_GZIP;
+#endif
+#ifdef HAVE_ZSTD
+    mask |= 1 << TRACE_CODEC_ZSTD;
+#endif
+#ifdef HAVE_LZ4
+    mask |= 1 << TRACE_CODEC_LZ4;
+#endif
+    return mask;
+}
+
+const char *trace_codec_name(int codec)
+{
+    switch (codec) {
+    case TRACE_CODEC_NONE:
+        return "none";
+    case TRACE_CODEC_GZIP:
+        return "gzip";
+    case TRACE_CODEC_ZSTD:
+        return "zstd";
+    case TRACE_CODEC_LZ4:
+        return "lz4";
+    }
+    return "unknown";
+}
+
+/* zstd if we have it: it compresses about as well as gzip -9, at a
+ * small fraction of the cost, and decompresses several times faster.
+ */
+int trace_codec_default(void)
+{
+    int mask = trace_codec_supported();
+
+    if (mask & (1 << TRACE_CODEC_ZSTD)) {
+        return TRACE_CODEC_ZSTD;
+    }
+    if (mask & (1 << TRACE_CODEC_GZIP)) {
+        return TRACE_CODEC_GZIP;
+    }
+    if (mask & (1 << TRACE_CODEC_LZ4)) {
+        return TRACE_CODEC_LZ4;
+    }
+    return TRACE_CODEC_NONE;
+}
+
+static int codec_default_level(int codec)
+{
+    switch (codec) {
+    case TRACE_CODEC_GZIP:
+        return 6;
+    case TRACE_CODEC_ZSTD:
+        return 3;
+    }
+    /* LZ4's fast mode; 3 and above select LZ4HC. */
+    return 0;
+}
+
+static bool codec_check(int codec, const char *what)
+{
+    if (!(trace_codec_supported() & (1 << codec))) {
+        fprintf(stderr, "trace: %s %s, but risu was built without it\n",
+                what, trace_codec_name(codec));
+        return false;
+    }
+    return true;
+}
+
+static void trace_reserve(uint8_t **buf, size_t *cap, size_t len)
+{
+    if (len > *cap) {
+        *cap = len > 2 * *cap ? len : 2 * *cap;
+        *buf = (uint8_t *)realloc(*buf, *cap);
+        if (!*buf) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* Compress a frame of the indexed format into t->stored. Returns the
+ * compressed length, or 0 if that failed.
+ */
+static size_t codec_compress_frame(trace_file_t *t, const uint8_t *src,
+                                   size_t len)
+{
+    switch (t->codec) {
+#ifdef HAVE_ZLIB
+    case TRACE_CODEC_GZIP: {
+        uLongf clen = compressBound(len);
+
+        trace_reserve(&t->stored, &t->stored_cap, clen);
+        if (compress2(t->stored, &clen, src, len, t->level) != Z_OK) {
+            return 0;
+        }
+        return clen;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case TRACE_CODEC_ZSTD: {
+        size_t clen = ZSTD_compressBound(len);
+
+        trace_reserve(&t->stored, &t->stored_cap, clen);
+        clen = ZSTD_compress2(t->zc, t->stored, clen, src, len);
+        return ZSTD_isError(clen) ? 0 : clen;
+    }
+#endif
+#ifdef HAVE_LZ4
+    case TRACE_CODEC_LZ4: {
+        int clen = LZ4_compressBound(len);
+
+        trace_reserve(&t->stored, &t->stored_cap, clen);
+        if (t->level >= LZ4HC_CLEVEL_MIN) {
+            clen = LZ4_compress_HC((const char *)src, (char *)t->stored,
+                                   len, clen, t->level);
+        } else {
+            clen = LZ4_compress_default((const char *)src,
+                                        (char *)t->stored, len, clen);
+        }
+        return clen > 0 ? clen : 0;
+    }
+#endif
+    }
+    return 0;
+}
+
+static bool codec_decompress_frame(trace_file_t *t, uint8_t *dst,
+                                   size_t len, const uint8_t *src,
+                                   size_t clen)
+{
+    switch (t->codec) {
+#ifdef HAVE_ZLIB
+    case TRACE_CODEC_GZIP: {
+        uLongf dlen = len;
+
+        return uncompress(dst, &dlen, src, clen) == Z_OK && dlen == len;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case TRACE_CODEC_ZSTD:
+        return ZSTD_decompressDCtx(t->zd, dst, len, src, clen) == len;
+#endif
+#ifdef HAVE_LZ4
+    case TRACE_CODEC_LZ4:
+        return LZ4_decompress_safe((const char *)src, (char *)dst,
+                                   clen, len) == (int)len;
+#endif
+    }
+    return false;
+}
+
+/* Set up t->codec for writing, at t->level and with threads worker
+ * threads (zstd only).
+ */
+static bool codec_init_write(trace_file_t *t, int threads)
+{
+    t->io_cap = TRACE_IO_SIZE;
+    switch (t->codec) {
+#ifdef HAVE_ZLIB
+    case TRACE_CODEC_GZIP:
+        if (t->format == TRACE_FORMAT_STREAM) {
+            /* 16 + MAX_WBITS: with a gzip header, so gunzip can read it */
+            if (deflateInit2(&t->zs, t->level, Z_DEFLATED, 16 + MAX_WBITS,
+                             8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                return false;
+            }
+            t->zs_live = true;
+        }
+        break;
+#endif
+#ifdef HAVE_ZSTD
+    case TRACE_CODEC_ZSTD:
+        t->zc = ZSTD_createCCtx();
+        if (!t->zc) {
+            return false;
+        }
+        ZSTD_CCtx_setParameter(t->zc, ZSTD_c_compressionLevel, t->level);
+        if (threads > 0
+            && ZSTD_isError(ZSTD_CCtx_setParameter(t->zc, ZSTD_c_nbWorkers,
+                                                   threads))) {
+            fprintf(stderr, "trace: this zstd has no worker threads\n");
+        }
+        break;
+#endif
+#ifdef HAVE_LZ4
+    case TRACE_CODEC_LZ4:
+        if (t->format == TRACE_FORMAT_STREAM) {
+            LZ4F_preferences_t prefs;
+
+            memset(&prefs, 0, sizeof(prefs));
+            prefs.compressionLevel = t->level;
+            if (LZ4F_isError(LZ4F_createCompressionContext(&t->lc,
+                                                           LZ4F_VERSION))) {
+                return false;
+            }
+            t->io_cap = LZ4F_compressBound(TRACE_IO_SIZE, &prefs);
+            if (t->io_cap < LZ4F_HEADER_SIZE_MAX) {
+                t->io_cap = LZ4F_HEADER_SIZE_MAX;
+            }
+            t->io = (uint8_t *)malloc(t->io_cap);
+            t->io_len = LZ4F_compressBegin(t->lc, t->io, t->io_cap, &prefs);
+            if (LZ4F_isError(t->io_len)) {
+                return false;
+            }
+        }
+        break;
+#endif
+    }
+    if (!t->io) {
+        t->io = (uint8_t *)malloc(t->io_cap);
+    }
+    return true;
+}
+
+static void codec_free(trace_file_t *t)
+{
+#ifdef HAVE_ZLIB
+    if (t->zs_live) {
+        if (t->writing) {
+            deflateEnd(&t->zs);
+        } else {
+            inflateEnd(&t->zs);
+        }
+    }
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(t->zc);
+    ZSTD_freeDCtx(t->zd);
+#endif
+#ifdef HAVE_LZ4
+    if (t->lc) {
+        LZ4F_freeCompressionContext(t->lc);
+    }
+    if (t->ld) {
+        LZ4F_freeDecompressionContext(t->ld);
+    }
+#endif
+}
+
+/*
+ * Columnar layout
+ *
+ * From one checkpoint to the next most registers keep their values, or
+ * change a little, but with the records stored one after another each
+ * register is surrounded by all the others and a compressor gets
+ * little out of that. In the columnar layout a frame is stored as
+ *
+ *   uint32_t records;
+ *   uint32_t length[records];   of each record, in order
+ *   tables
+ *
+ * Records of the same length (the same kind of record, as far as
+ * risu is concerned) make up a table, with one row per record and one
+ * column per 32 bit word: gregs[i], the halves of fpregs[i] and so on.
+ * Each row is XORed with the row before it, and the tables are stored
+ * a column at a time, in the order of their first records. A register
+ * that doesn't change is then a run of zeroes, and so is any part of
+ * the memory block that the test leaves alone.
+ */
+
+#define COLUMN_WORDS(len) (((len) + 3) / 4)
+
+typedef struct {
+    uint32_t *start;    /* of each record in the frame */
+    uint32_t *len;
+    uint32_t *table;    /* which table each record is in */
+    uint32_t *row;      /* and its row there */
+    uint32_t *prev;     /* the record in the row before, or -1 */
+    uint32_t *trows;    /* rows in each table */
+    uint32_t *toff;     /* where each table is in the layout */
+} columns_plan_t;
+
+/* Work out the tables for n records, whose lengths are in plan->len
+ * and start in plan->start. Returns the size of the layout.
+ */
+static size_t columns_plan(columns_plan_t *plan, uint32_t n)
+{
+    uint32_t *tlen = (uint32_t *)malloc((n + 1) * sizeof(uint32_t));
+    uint32_t *last = (uint32_t *)malloc((n + 1) * sizeof(uint32_t));
+    uint32_t ntables = 0, i, j;
+    size_t size = 4 + 4 * (size_t)n;
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < ntables && tlen[j] != plan->len[i]; j++) {
+            continue;
+        }
+        if (j == ntables) {
+            tlen[ntables] = plan->len[i];
+            plan->trows[ntables] = 0;
+            last[ntables++] = -1;
+        }
+        plan->table[i] = j;
+        plan->row[i] = plan->trows[j]++;
+        plan->prev[i] = last[j];
+        last[j] = i;
+    }
+    for (j = 0; j < ntables; j++) {
+        plan->toff[j] = size;
+        size += (size_t)plan->trows[j] * COLUMN_WORDS(tlen[j]) * 4;
+    }
+    free(tlen);
+    free(last);
+    return size;
+}
+
+static void columns_alloc(columns_plan_t *plan, uint32_t n)
+{
+    uint32_t *p = (uint32_t *)malloc((7 * n + 1) * sizeof(uint32_t));
+
+    plan->start = p;
+    plan->len = p + n;
+    plan->table = p + 2 * n;
+    plan->row = p + 3 * n;
+    plan->prev = p + 4 * n;
+    plan->trows = p + 5 * n;
+    plan->toff = p + 6 * n;
+}
+
+/* Where word w of record i lives in the layout */
+static size_t columns_at(const columns_plan_t *plan, uint32_t i, uint32_t w)
+{
+    uint32_t j = plan->table[i];
+
+    return plan->toff[j] + ((size_t)w * plan->trows[j] + plan->row[i]) * 4;
+}
+
+/* Make room for n record marks */
+static void columns_reserve_marks(trace_file_t *t, uint32_t n)
+{
+    if (n <= t->marks_cap) {
+        return;
+    }
+    while (n > t->marks_cap) {
+        t->marks_cap = t->marks_cap ? 2 * t->marks_cap : 256;
+    }
+    t->marks = (uint32_t *)realloc(t->marks, t->marks_cap * sizeof(uint32_t));
+    if (!t->marks) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Lay out t->frame, whose records start at t->marks, in t->cols.
+ * Returns the size of the layout.
+ */
+static size_t columns_encode(trace_file_t *t)
+{
+    uint32_t n = t->frame_records, i, w;
+    columns_plan_t plan;
+    size_t size;
+
+    /* Anything written before the first mark is a record of its own. */
+    if (n == 0 || t->marks[0] != 0) {
+        columns_reserve_marks(t, n + 1);
+        memmove(t->marks + 1, t->marks, n * sizeof(uint32_t));
+        t->marks[0] = 0;
+        n++;
+    }
+    columns_alloc(&plan, n);
+    for (i = 0; i < n; i++) {
+        plan.start[i] = t->marks[i];
+        plan.len[i] = (i + 1 < n ? t->marks[i + 1] : t->frame_len)
+                      - t->marks[i];
+    }
+    size = columns_plan(&plan, n);
+
+    trace_reserve(&t->cols, &t->cols_cap, size);
+    put32(t->cols, n);
+    for (i = 0; i < n; i++) {
+        const uint8_t *rec = t->frame + plan.start[i];
+        const uint8_t *prev = NULL;
+
+        put32(t->cols + 4 + 4 * i, plan.len[i]);
+        if (plan.prev[i] != (uint32_t)-1) {
+            prev = t->frame + plan.start[plan.prev[i]];
+        }
+        for (w = 0; w < COLUMN_WORDS(plan.len[i]); w++) {
+            uint32_t k = plan.len[i] - 4 * w < 4 ? plan.len[i] - 4 * w : 4;
+            uint32_t a = 0, b = 0;
+
+            memcpy(&a, rec + 4 * w, k);
+            if (prev) {
+                memcpy(&b, prev + 4 * w, k);
+            }
+            a ^= b;
+            memcpy(t->cols + columns_at(&plan, i, w), &a, 4);
+        }
+    }
+    free(plan.start);
+    return size;
+}
+
+/* Rebuild the raw_len bytes of a frame in dst from its layout in src. */
+static bool columns_decode(const uint8_t *src, size_t size, uint8_t *dst,
+                           size_t raw_len)
+{
+    uint32_t n, i, w;
+    columns_plan_t plan;
+    size_t pos = 0;
+    bool ok;
+
+    if (size < 4 || (n = get32(src)) > (size - 4) / 4) {
+        return false;
+    }
+    columns_alloc(&plan, n);
+    for (i = 0; i < n; i++) {
+        plan.len[i] = get32(src + 4 + 4 * i);
+        if (plan.len[i] > raw_len) {
+            free(plan.start);
+            return false;
+        }
+        plan.start[i] = pos;
+        pos += plan.len[i];
+    }
+    ok = pos == raw_len && columns_plan(&plan, n) == size;
+    for (i = 0; ok && i < n; i++) {
+        uint8_t *rec = dst + plan.start[i];
+        const uint8_t *prev = NULL;
+
+        if (plan.prev[i] != (uint32_t)-1) {
+            prev = dst + plan.start[plan.prev[i]];
+        }
+        for (w = 0; w < COLUMN_WORDS(plan.len[i]); w++) {
+            uint32_t k = plan.len[i] - 4 * w < 4 ? plan.len[i] - 4 * w : 4;
+            uint32_t a, b = 0;
+
+            memcpy(&a, src + columns_at(&plan, i, w), 4);
+            if (prev) {
+                memcpy(&b, prev + 4 * w, k);
+            }
+            a ^= b;
+            memcpy(rec + 4 * w, &a, k);
+        }
+    }
+    free(plan.start);
+    return ok;
+}
+
+/* Low level i/o */
+
+/* Write all of buf, returns false on error. */
+static bool write_full(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+
+    while (len) {
+        long n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* Top up the input buffer to at least want bytes (or as many as there
+ * are). Returns false on a read error.
+ */
+static bool trace_fill(trace_file_t *t, size_t want)
+{
+    if (t->mapped) {
+        return true;
+    }
+    if (t->io_pos == t->io_len) {
+        t->io_pos = t->io_len = 0;
+    }
+    while (t->io_len - t->io_pos < want && !t->eof) {
+        long n;
+
+        if (t->io_len == t->io_cap) {
+            memmove(t->io, t->io + t->io_pos, t->io_len - t->io_pos);
+            t->io_len -= t->io_pos;
+            t->io_pos = 0;
+        }
+        n = read(t->fd, t->io + t->io_len, t->io_cap - t->io_len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return false;
+        }
+        if (n == 0) {
+            t->eof = true;
+        }
+        t->io_len += n;
+    }
+    return true;
+}
+
+/* Read up to len raw bytes (fewer only at the end of the file), using
+ * up buffered input first. Returns the number read, or -1 on error.
+ */
+static long read_full(trace_file_t *t, void *buf, size_t len)
+{
+    uint8_t *p = (uint8_t *)buf;
+    size_t done = t->io_len - t->io_pos;
+
+    if (done > len) {
+        done = len;
+    }
+    memcpy(p, t->io + t->io_pos, done);
+    t->io_pos += done;
+    while (done < len && !t->eof) {
+        long n = read(t->fd, p + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            t->eof = true;
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+static void trace_add_index(trace_file_t *t, const trace_frame_t *f)
+{
+    if (t->nindex == t->index_cap) {
+        t->index_cap = t->index_cap ? 2 * t->index_cap : 64;
+        t->index = (trace_frame_t *)realloc(t->index,
+                                            t->index_cap * sizeof(*f));
+        if (!t->index) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    t->index[t->nindex++] = *f;
+}
+
+/* Writing */
+
+#ifdef HAVE_PTHREAD
+static bool trace_start_writer(trace_file_t *t);
+static RisuResult trace_stop_writer(trace_file_t *t);
+#endif
+
+trace_file_t *trace_open_write(int fd, const trace_opts_t *opts)
+{
+    trace_file_t *t = (trace_file_t *)calloc(1, sizeof(*t));
+
+    t->fd = fd;
+    t->writing = true;
+    /* Until the first mark, there are no records. */
+    t->chain_from = SIZE_MAX;
+    t->format = opts->format;
+    t->codec = opts->codec < 0 ? trace_codec_default() : opts->codec;
+    t->level = opts->level ? opts->level : codec_default_level(t->codec);
+    t->layout = opts->layout;
+    if (t->layout == TRACE_LAYOUT_COLUMNS
+        && t->format != TRACE_FORMAT_INDEXED) {
+        fprintf(stderr, "trace: the columnar layout needs the indexed "
+                "format\n");
+        goto fail;
+    }
+    if (!codec_check(t->codec, "asked for")
+        || !codec_init_write(t, opts->threads)) {
+        goto fail;
+    }
+
+    if (t->format == TRACE_FORMAT_INDEXED) {
+        uint8_t hdr[TRACE_HEADER_LEN];
+
+        put32(hdr, TRACE_MAGIC);
+        put32(hdr + 4, t->layout == TRACE_LAYOUT_COLUMNS
+                       ? TRACE_VERSION_COLUMNS : TRACE_VERSION);
+        put32(hdr + 8, t->codec);
+        put32(hdr + 12, TRACE_FRAME_SIZE);
+        if (!write_full(fd, hdr, sizeof(hdr))) {
+            goto fail;
+        }
+        t->offset = sizeof(hdr);
+    }
+#ifdef HAVE_PTHREAD
+    /* A writer thread only helps if it can run alongside us. */
+    if (opts->async && sysconf(_SC_NPROCESSORS_ONLN) > 1
+        && !trace_start_writer(t)) {
+        goto fail;
+    }
+#endif
+    return t;
+
+fail:
+    codec_free(t);
+#ifdef HAVE_PTHREAD
+    free(t->queue);
+    free(t->entry);
+#endif
+    free(t->io);
+    free(t);
+    return NULL;
+}
+
+/* Encode and write out the bytes waiting in t->frame (stream format);
+ * with end, finish the stream too.
+ */
+static RisuResult trace_encode(trace_file_t *t, bool end)
+{
+    const uint8_t *src = t->frame;
+    size_t len = t->frame_len;
+
+    t->frame_len = 0;
+    switch (t->codec) {
+#ifdef HAVE_ZLIB
+    case TRACE_CODEC_GZIP:
+        t->zs.next_in = (Bytef *)src;
+        t->zs.avail_in = len;
+        do {
+            t->zs.next_out = t->io;
+            t->zs.avail_out = t->io_cap;
+            if (deflate(&t->zs, end ? Z_FINISH : Z_NO_FLUSH) == Z_STREAM_ERROR
+                || !write_full(t->fd, t->io, t->io_cap - t->zs.avail_out)) {
+                return RES_BAD_IO;
+            }
+        } while (t->zs.avail_out == 0);
+        return RES_OK;
+#endif
+#ifdef HAVE_ZSTD
+    case TRACE_CODEC_ZSTD: {
+        ZSTD_inBuffer in = { src, len, 0 };
+        size_t left;
+
+        do {
+            ZSTD_outBuffer out = { t->io, t->io_cap, 0 };
+
+            left = ZSTD_compressStream2(t->zc, &out, &in,
+                                        end ? ZSTD_e_end : ZSTD_e_continue);
+            if (ZSTD_isError(left) || !write_full(t->fd, t->io, out.pos)) {
+                return RES_BAD_IO;
+            }
+        } while (end ? left != 0 : in.pos < in.size);
+        return RES_OK;
+    }
+#endif
+#ifdef HAVE_LZ4
+    case TRACE_CODEC_LZ4: {
+        /* The frame header from codec_init_write() goes out first. */
+        size_t n = t->io_len;
+
+        t->io_len = 0;
+        if (len) {
+            size_t r = LZ4F_compressUpdate(t->lc, t->io + n, t->io_cap - n,
+                                           src, len, NULL);
+            if (LZ4F_isError(r)) {
+                return RES_BAD_IO;
+            }
+            n += r;
+        }
+        if (!write_full(t->fd, t->io, n)) {
+            return RES_BAD_IO;
+        }
+        if (end) {
+            n = LZ4F_compressEnd(t->lc, t->io, t->io_cap, NULL);
+            if (LZ4F_isError(n) || !write_full(t->fd, t->io, n)) {
+                return RES_BAD_IO;
+            }
+        }
+        return RES_OK;
+    }
+#endif
+    }
+    return write_full(t->fd, src, len) ? RES_OK : RES_BAD_IO;
+}
+
+static RisuResult trace_flush_frame(trace_file_t *t)
+{
+    uint8_t hdr[TRACE_FRAME_LEN];
+    uint8_t cols_len[4];
+    bool columns = t->layout == TRACE_LAYOUT_COLUMNS;
+    const uint8_t *data = t->frame;
+    size_t len = t->frame_len, stored_len;
+    trace_frame_t f;
+
+    if (t->frame_len == 0) {
+        return RES_OK;
+    }
+
+    /* Whatever comes before the first mark (the metadata) describes
+     * the trace rather than the run, so it is left out of the chain.
+     */
+    if (t->chain_from < t->frame_len) {
+        t->chain = risu_hash64(t->frame + t->chain_from,
+                               t->frame_len - t->chain_from, t->chain);
+    }
+    t->chain_from = 0;
+
+    if (columns) {
+        len = columns_encode(t);
+        data = t->cols;
+        put32(cols_len, len);
+    }
+    stored_len = len;
+    if (t->codec != TRACE_CODEC_NONE) {
+        size_t clen = codec_compress_frame(t, data, len);
+
+        /* Row layout frames are stored as they are if that's smaller,
+         * columnar ones are always compressed.
+         */
+        if (clen && (columns || clen < len)) {
+            data = t->stored;
+            stored_len = clen;
+        } else if (columns) {
+            return RES_BAD_IO;
+        }
+    }
+
+    put32(hdr, TRACE_FRAME);
+    put32(hdr + 4, t->frame_len);
+    put32(hdr + 8, stored_len + (columns ? sizeof(cols_len) : 0));
+    put32(hdr + 12, t->frame_records);
+    if (!write_full(t->fd, hdr, sizeof(hdr))
+        || (columns && !write_full(t->fd, cols_len, sizeof(cols_len)))
+        || !write_full(t->fd, data, stored_len)) {
+        return RES_BAD_IO;
+    }
+    if (columns) {
+        stored_len += sizeof(cols_len);
+    }
+
+    f.offset = t->offset;
+    f.first = t->records;
+    f.records = t->frame_records;
+    f.min_pc = t->frame_min_pc;
+    f.max_pc = t->frame_max_pc;
+    f.raw_len = t->frame_len;
+    f.chain = t->chain;
+    f.setup = t->frame_setup;
+    trace_add_index(t, &f);
+
+    t->offset += sizeof(hdr) + stored_len;
+    t->records += t->frame_records;
+    t->frame_records = 0;
+    t->frame_len = 0;
+    return RES_OK;
+}
+
+static RisuResult trace_do_mark(trace_file_t *t, uint32_t image_offset,
+                                bool setup)
+{
+    if (t->format != TRACE_FORMAT_INDEXED) {
+        return RES_OK;
+    }
+    if (t->frame_len >= TRACE_FRAME_SIZE) {
+        RisuResult res = trace_flush_frame(t);
+        if (res != RES_OK) {
+            return res;
+        }
+    }
+    if (t->chain_from == SIZE_MAX) {
+        t->chain_from = t->frame_len;
+    }
+    if (t->layout == TRACE_LAYOUT_COLUMNS) {
+        /* One spare, for columns_encode() */
+        columns_reserve_marks(t, t->frame_records + 2);
+        t->marks[t->frame_records] = t->frame_len;
+    }
+    if (t->frame_records == 0) {
+        t->frame_setup = setup;
+    }
+    if (t->frame_records == 0 || image_offset < t->frame_min_pc) {
+        t->frame_min_pc = image_offset;
+    }
+    if (t->frame_records == 0 || image_offset > t->frame_max_pc) {
+        t->frame_max_pc = image_offset;
+    }
+    t->frame_records++;
+    return RES_OK;
+}
+
+static RisuResult trace_do_write(trace_file_t *t, const void *ptr,
+                                 size_t bytes)
+{
+    if (t->format == TRACE_FORMAT_STREAM
+        && t->frame_len + bytes > TRACE_IO_SIZE) {
+        RisuResult res = trace_encode(t, false);
+        if (res != RES_OK) {
+            return res;
+        }
+    }
+    trace_reserve(&t->frame, &t->frame_cap, t->frame_len + bytes);
+    memcpy(t->frame + t->frame_len, ptr, bytes);
+    t->frame_len += bytes;
+    return RES_OK;
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * The writer thread.
+ *
+ * Recording happens in the SIGILL handler, so with a writer thread the
+ * handler only copies each record into the queue and the compression
+ * and writes happen alongside the code under test. The queue is a
+ * single producer, single consumer ring like the shared memory channel
+ * in comms.c, with no locks that the handler could deadlock on. When
+ * it is full the handler waits for the writer to catch up.
+ */
+
+static uint32_t queue_load(uint32_t *p)
+{
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+static void queue_store(uint32_t *p, uint32_t val)
+{
+    __atomic_store_n(p, val, __ATOMIC_SEQ_CST);
+}
+
+/* Sleep while *p still holds val (or until woken), *waiting telling
+ * the other side to wake us.
+ */
+static void queue_wait(uint32_t *p, uint32_t val, uint32_t *waiting)
+{
+    queue_store(waiting, 1);
+    if (queue_load(p) == val) {
+#ifdef __linux__
+        struct timespec ts = { 0, 100 * 1000 * 1000 };
+        syscall(SYS_futex, p, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+#else
+        usleep(1000);
+#endif
+    }
+    queue_store(waiting, 0);
+}
+
+static void queue_wake(uint32_t *p, uint32_t *waiting)
+{
+    if (queue_load(waiting)) {
+#ifdef __linux__
+        syscall(SYS_futex, p, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+    }
+}
+
+static void queue_copy_in(trace_file_t *t, uint32_t pos, const void *src,
+                          size_t len)
+{
+    uint32_t first;
+
+    pos &= TRACE_QUEUE_SIZE - 1;
+    first = len < TRACE_QUEUE_SIZE - pos ? len : TRACE_QUEUE_SIZE - pos;
+    memcpy(t->queue + pos, src, first);
+    memcpy(t->queue, (const uint8_t *)src + first, len - first);
+}
+
+static void queue_copy_out(trace_file_t *t, uint32_t pos, void *dst,
+                           size_t len)
+{
+    uint32_t first;
+
+    pos &= TRACE_QUEUE_SIZE - 1;
+    first = len < TRACE_QUEUE_SIZE - pos ? len : TRACE_QUEUE_SIZE - pos;
+    memcpy(dst, t->queue + pos, first);
+    memcpy((uint8_t *)dst + first, t->queue, len - first);
+}
+
+/* Wait for the writer to be done with everything queued so far. */
+static RisuResult queue_drain(trace_file_t *t)
+{
+    uint32_t tail = t->q_tail;
+    uint32_t done;
+
+    for (;;) {
+        if (queue_load(&t->q_res) != RES_OK) {
+            return (RisuResult)queue_load(&t->q_res);
+        }
+        done = queue_load(&t->q_done);
+        if (done == tail) {
+            return RES_OK;
+        }
+        /* It may be sitting on less than a batch. */
+        queue_wake(&t->q_tail, &t->q_rd_wait);
+        queue_wait(&t->q_done, done, &t->q_wr_wait);
+    }
+}
+
+/* Queue an entry, waiting for room if need be. */
+static RisuResult queue_put(trace_file_t *t, uint32_t tag, const void *ptr,
+                            size_t bytes)
+{
+    uint32_t tail = t->q_tail;
+    uint32_t head;
+
+    if (bytes > TRACE_QUEUE_SIZE / 2) {
+        /*
+         * Too big for the queue: once the writer has caught up it is
+         * idle, so write this one from here, in order.
+         */
+        RisuResult res = queue_drain(t);
+        return res == RES_OK ? trace_do_write(t, ptr, bytes) : res;
+    }
+    for (;;) {
+        if (queue_load(&t->q_res) != RES_OK) {
+            return (RisuResult)queue_load(&t->q_res);
+        }
+        head = queue_load(&t->q_head);
+        if (TRACE_QUEUE_SIZE - (tail - head) >= sizeof(tag) + bytes) {
+            break;
+        }
+        queue_wait(&t->q_head, head, &t->q_wr_wait);
+    }
+    queue_copy_in(t, tail, &tag, sizeof(tag));
+    queue_copy_in(t, tail + sizeof(tag), ptr, bytes);
+    tail += sizeof(tag) + bytes;
+    queue_store(&t->q_tail, tail);
+    if (tail - head >= TRACE_QUEUE_BATCH) {
+        queue_wake(&t->q_tail, &t->q_rd_wait);
+    }
+    return RES_OK;
+}
+
+static void *trace_writer(void *opaque)
+{
+    trace_file_t *t = (trace_file_t *)opaque;
+    uint32_t head = t->q_head;
+
+    for (;;) {
+        /* Closing is set after the last entry is queued, so check it
+         * first: then an empty queue really is the end.
+         */
+        uint32_t closing = queue_load(&t->q_closing);
+        uint32_t tail = queue_load(&t->q_tail);
+        uint32_t tag, len;
+        RisuResult res;
+
+        if (head == tail) {
+            if (closing) {
+                break;
+            }
+            queue_wait(&t->q_tail, tail, &t->q_rd_wait);
+            continue;
+        }
+        queue_copy_out(t, head, &tag, sizeof(tag));
+        len = tag & TRACE_QUEUE_MARK ? 2 * sizeof(uint32_t) : tag;
+        queue_copy_out(t, head + sizeof(tag), t->entry, len);
+        head += sizeof(tag) + len;
+        queue_store(&t->q_head, head);
+        queue_wake(&t->q_head, &t->q_wr_wait);
+
+        /* After an error, just keep the queue moving. */
+        if (queue_load(&t->q_res) != RES_OK) {
+            continue;
+        }
+        if (tag & TRACE_QUEUE_MARK) {
+            uint32_t mark[2];
+            memcpy(mark, t->entry, sizeof(mark));
+            res = trace_do_mark(t, mark[0], mark[1]);
+        } else {
+            res = trace_do_write(t, t->entry, len);
+        }
+        if (res != RES_OK) {
+            queue_store(&t->q_res, res);
+        }
+        queue_store(&t->q_done, head);
+        if (head == queue_load(&t->q_tail)) {
+            queue_wake(&t->q_done, &t->q_wr_wait);
+        }
+    }
+    return NULL;
+}
+
+static bool trace_start_thread(trace_file_t *t, void *(*fn)(void *),
+                               size_t entry_size, const char *what)
+{
+    sigset_t all, old;
+    int err;
+
+    t->queue = (uint8_t *)malloc(TRACE_QUEUE_SIZE);
+    t->entry = (uint8_t *)malloc(entry_size);
+    if (!t->queue || !t->entry) {
+        return false;
+    }
+    /* Leave all signals, and SIGILL in particular, to the main thread. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&t->thread, NULL, fn, t);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {
+        fprintf(stderr, "trace: cannot start the %s thread: %s\n",
+                what, strerror(err));
+        return false;
+    }
+    t->async = true;
+    return true;
+}
+
+static bool trace_start_writer(trace_file_t *t)
+{
+    return trace_start_thread(t, trace_writer, TRACE_QUEUE_SIZE / 2,
+                              "writer");
+}
+
+/* Let the writer thread empty the queue, and wait for it to finish. */
+static RisuResult trace_stop_writer(trace_file_t *t)
+{
+    queue_store(&t->q_closing, 1);
+    queue_store(&t->q_rd_wait, 1);
+    queue_wake(&t->q_tail, &t->q_rd_wait);
+    pthread_join(t->thread, NULL);
+    t->async = false;
+    return (RisuResult)t->q_res;
+}
+#endif
+
+/* Note that a record for the instruction at image_offset starts here,
+ * in setup code or not.
+ */
+RisuResult trace_mark(trace_file_t *t, uint32_t image_offset, bool setup)
+{
+#ifdef HAVE_PTHREAD
+    if (t->async) {
+        uint32_t mark[2] = { image_offset, setup };
+
+        if (t->format != TRACE_FORMAT_INDEXED) {
+            return RES_OK;
+        }
+        return queue_put(t, TRACE_QUEUE_MARK, mark, sizeof(mark));
+    }
+#endif
+    return trace_do_mark(t, image_offset, setup);
+}
+
+RisuResult trace_write(trace_file_t *t, const void *ptr, size_t bytes)
+{
+#ifdef HAVE_PTHREAD
+    if (t->async) {
+        return queue_put(t, bytes, ptr, bytes);
+    }
+#endif
+    return trace_do_write(t, ptr, bytes);
+}
+
+/* The index entry of a frame:
+ *
+ *   uint32_t offset[2];   file offset of the frame, high word first
+ *   uint32_t first[2];    its first checkpoint, high word first
+ *   uint32_t records;     checkpoints in the frame
+ *   uint32_t min_pc;      lowest and highest image offset of
+ *   uint32_t max_pc;      the instructions they were taken at
+ *   uint32_t raw_len;     uncompressed size
+ */
+static void trace_put_index(uint8_t *p, const trace_frame_t *f)
+{
+    put32(p, (uint32_t)(f->offset >> 32));
+    put32(p + 4, (uint32_t)f->offset);
+    put32(p + 8, (uint32_t)(f->first >> 32));
+    put32(p + 12, (uint32_t)f->first);
+    put32(p + 16, f->records);
+    put32(p + 20, f->min_pc);
+    put32(p + 24, f->max_pc);
+    put32(p + 28, f->raw_len);
+}
+
+static void trace_get_index(const uint8_t *p, trace_frame_t *f)
+{
+    f->offset = ((uint64_t)get32(p) << 32) | get32(p + 4);
+    f->first = ((uint64_t)get32(p + 8) << 32) | get32(p + 12);
+    f->records = get32(p + 16);
+    f->min_pc = get32(p + 20);
+    f->max_pc = get32(p + 24);
+    f->raw_len = get32(p + 28);
+}
+
+/* The frames' anchors, which go right before the index:
+ *
+ *   uint32_t magic;       'RCHN'
+ *   uint32_t frames;      as many as the index has
+ *   uint32_t chain[2];    per frame, high word first
+ */
+#define TRACE_CHAIN_LEN(n) (8 + (n) * 8)
+
+/* The frames' setup bytes, which go right before the anchors:
+ *
+ *   uint32_t magic;       'RSET'
+ *   uint32_t frames;      as many as the index has
+ *   uint8_t setup;        per frame, 1 if it starts in setup code,
+ *                         then zeros up to a multiple of 4 bytes
+ */
+#define TRACE_SETUP_LEN(n) (8 + (((n) + 3) & ~3))
+
+static RisuResult trace_finish(trace_file_t *t)
+{
+    uint8_t trailer[TRACE_TRAILER_LEN];
+    uint8_t *buf, *chain, *setup;
+    uint64_t index_offset;
+    RisuResult res;
+    int i;
+
+    res = trace_flush_frame(t);
+    if (res != RES_OK) {
+        return res;
+    }
+
+    setup = (uint8_t *)calloc(1, TRACE_SETUP_LEN(t->nindex));
+    chain = (uint8_t *)malloc(TRACE_CHAIN_LEN(t->nindex));
+    buf = (uint8_t *)malloc(t->nindex * TRACE_ENTRY_LEN + 1);
+    if (!setup || !chain || !buf) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    put32(setup, TRACE_SETUP);
+    put32(setup + 4, t->nindex);
+    for (i = 0; i < t->nindex; i++) {
+        setup[8 + i] = t->index[i].setup;
+    }
+    put32(chain, TRACE_CHAIN);
+    put32(chain + 4, t->nindex);
+    for (i = 0; i < t->nindex; i++) {
+        put32(chain + 8 + i * 8, (uint32_t)(t->index[i].chain >> 32));
+        put32(chain + 12 + i * 8, (uint32_t)t->index[i].chain);
+    }
+    for (i = 0; i < t->nindex; i++) {
+        trace_put_index(buf + i * TRACE_ENTRY_LEN, &t->index[i]);
+    }
+    index_offset = t->offset + TRACE_SETUP_LEN(t->nindex)
+                   + TRACE_CHAIN_LEN(t->nindex);
+    put32(trailer, TRACE_INDEX);
+    put32(trailer + 4, t->nindex);
+    put32(trailer + 8, (uint32_t)(index_offset >> 32));
+    put32(trailer + 12, (uint32_t)index_offset);
+    if (!write_full(t->fd, setup, TRACE_SETUP_LEN(t->nindex))
+        || !write_full(t->fd, chain, TRACE_CHAIN_LEN(t->nindex))
+        || !write_full(t->fd, buf, t->nindex * TRACE_ENTRY_LEN)
+        || !write_full(t->fd, trailer, sizeof(trailer))) {
+        res = RES_BAD_IO;
+    }
+    free(setup);
+    free(chain);
+    free(buf);
+    return res;
+}
+
+/* Reading */
+
+/* Continue reading at offset in the file. */
+static bool trace_at(trace_file_t *t, long offset)
+{
+    if (t->mapped) {
+        if (offset < 0 || (size_t)offset > t->io_len) {
+            return false;
+        }
+        t->io_pos = offset;
+        return true;
+    }
+    t->io_pos = t->io_len = 0;
+    t->eof = false;
+    return lseek(t->fd, offset, SEEK_SET) == offset;
+}
+
+/* Load the index of an indexed trace, if the file has one (it doesn't
+ * when reading from a pipe, or if the writer didn't finish).
+ */
+static void trace_load_index(trace_file_t *t)
+{
+    uint8_t trailer[TRACE_TRAILER_LEN];
+    uint8_t *buf;
+    long end, index_offset;
+    uint32_t n, i;
+
+    if (t->mapped) {
+        end = t->io_len;
+    } else {
+        if (lseek(t->fd, 0, SEEK_CUR) < 0) {
+            /* A pipe: keep what we have read, and go on from there. */
+            return;
+        }
+        end = lseek(t->fd, 0, SEEK_END);
+    }
+    if (end < (long)(TRACE_HEADER_LEN + TRACE_TRAILER_LEN)
+        || !trace_at(t, end - TRACE_TRAILER_LEN)
+        || read_full(t, trailer, sizeof(trailer)) != sizeof(trailer)
+        || get32(trailer) != TRACE_INDEX) {
+        goto done;
+    }
+    n = get32(trailer + 4);
+    index_offset = ((uint64_t)get32(trailer + 8) << 32) | get32(trailer + 12);
+    /* Don't trust n to size anything before it fits in the file. */
+    if (n > (uint32_t)((end - TRACE_HEADER_LEN - TRACE_TRAILER_LEN)
+                       / TRACE_ENTRY_LEN)
+        || index_offset < (long)TRACE_HEADER_LEN
+        || index_offset + (long)n * TRACE_ENTRY_LEN
+           + TRACE_TRAILER_LEN != end) {
+        goto done;
+    }
+
+    buf = (uint8_t *)malloc(n * TRACE_ENTRY_LEN + 1);
+    if (!buf) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    if (trace_at(t, index_offset)
+        && read_full(t, buf, n * TRACE_ENTRY_LEN) == n * TRACE_ENTRY_LEN) {
+        for (i = 0; i < n; i++) {
+            trace_frame_t f;
+            trace_get_index(buf + i * TRACE_ENTRY_LEN, &f);
+            f.chain = 0;
+            f.setup = false;
+            trace_add_index(t, &f);
+        }
+    }
+    free(buf);
+
+    /* Older traces have no anchors. */
+    if (t->nindex == (int)n
+        && index_offset >= (long)(TRACE_HEADER_LEN + TRACE_CHAIN_LEN(n))) {
+        buf = (uint8_t *)malloc(TRACE_CHAIN_LEN(n));
+        if (!buf) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        if (trace_at(t, index_offset - TRACE_CHAIN_LEN(n))
+            && read_full(t, buf, TRACE_CHAIN_LEN(n)) == TRACE_CHAIN_LEN(n)
+            && get32(buf) == TRACE_CHAIN && get32(buf + 4) == n) {
+            for (i = 0; i < n; i++) {
+                t->index[i].chain = ((uint64_t)get32(buf + 8 + i * 8) << 32)
+                                    | get32(buf + 12 + i * 8);
+            }
+            t->chained = true;
+        }
+        free(buf);
+    }
+
+    /* Nor setup bytes, which come before the anchors. */
+    if (t->chained
+        && index_offset >= (long)(TRACE_HEADER_LEN + TRACE_SETUP_LEN(n)
+                                  + TRACE_CHAIN_LEN(n))) {
+        long setup_offset = index_offset - TRACE_CHAIN_LEN(n)
+                            - TRACE_SETUP_LEN(n);
+
+        buf = (uint8_t *)malloc(TRACE_SETUP_LEN(n));
+        if (!buf) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        if (trace_at(t, setup_offset)
+            && read_full(t, buf, TRACE_SETUP_LEN(n)) == TRACE_SETUP_LEN(n)
+            && get32(buf) == TRACE_SETUP && get32(buf + 4) == n) {
+            for (i = 0; i < n; i++) {
+                t->index[i].setup = buf[8 + i] != 0;
+            }
+            t->setup_known = true;
+        }
+        free(buf);
+    }
+
+done:
+    trace_at(t, TRACE_HEADER_LEN);
+}
+
+/* Map a trace file that is a regular file, so that playback can read
+ * it without any copying into buffers or system calls.
+ */
+static void trace_map(trace_file_t *t)
+{
+#ifndef RISU_MACOS9
+    struct stat st;
+    void *p;
+
+    if (fstat(t->fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0
+        || (uint64_t)st.st_size != (size_t)st.st_size
+        || lseek(t->fd, 0, SEEK_CUR) != 0) {
+        return;
+    }
+    /* Private and writable, so records can be byte swapped in place. */
+    p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+             t->fd, 0);
+    if (p == MAP_FAILED) {
+        return;
+    }
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    t->io = (uint8_t *)p;
+    t->io_len = t->io_cap = st.st_size;
+    t->mapped = true;
+    t->eof = true;
+#endif
+}
+
+static void trace_free_io(trace_file_t *t)
+{
+#ifndef RISU_MACOS9
+    if (t->mapped) {
+        munmap(t->io, t->io_cap);
+        return;
+    }
+#endif
+    free(t->io);
+}
+
+#ifdef HAVE_PTHREAD
+static void *trace_reader(void *opaque);
+static void trace_stop_reader(trace_file_t *t);
+#endif
+
+/* Set up for reading a stream compressed with t->codec. */
+static bool codec_init_read(trace_file_t *t)
+{
+    if (!codec_check(t->codec, "trace is compressed with")) {
+        return false;
+    }
+    switch (t->codec) {
+#ifdef HAVE_ZLIB
+    case TRACE_CODEC_GZIP:
+        if (t->format == TRACE_FORMAT_STREAM) {
+            /* 32 + MAX_WBITS: accept a zlib or gzip header */
+            if (inflateInit2(&t->zs, 32 + MAX_WBITS) != Z_OK) {
+                return false;
+            }
+            t->zs_live = true;
+        }
+        break;
+#endif
+#ifdef HAVE_ZSTD
+    case TRACE_CODEC_ZSTD:
+        t->zd = ZSTD_createDCtx();
+        return t->zd != NULL;
+#endif
+#ifdef HAVE_LZ4
+    case TRACE_CODEC_LZ4:
+        if (t->format == TRACE_FORMAT_STREAM) {
+            return !LZ4F_isError(LZ4F_createDecompressionContext(&t->ld,
+                                                                 LZ4F_VERSION));
+        }
+        break;
+#endif
+    }
+    return true;
+}
+
+trace_file_t *trace_open_read(int fd)
+{
+    trace_file_t *t = (trace_file_t *)calloc(1, sizeof(*t));
+    uint32_t magic = 0;
+
+    t->fd = fd;
+    trace_map(t);
+    if (!t->mapped) {
+        t->io_cap = TRACE_IO_SIZE;
+        t->io = (uint8_t *)malloc(t->io_cap);
+    }
+    if (!trace_fill(t, TRACE_HEADER_LEN)) {
+        goto fail;
+    }
+    if (t->io_len >= 4) {
+        magic = get32(t->io);
+    }
+
+    if (magic == TRACE_MAGIC && t->io_len >= TRACE_HEADER_LEN) {
+        switch (get32(t->io + 4)) {
+        case TRACE_VERSION:
+            t->layout = TRACE_LAYOUT_ROWS;
+            break;
+        case TRACE_VERSION_COLUMNS:
+            t->layout = TRACE_LAYOUT_COLUMNS;
+            break;
+        default:
+            fprintf(stderr, "trace: unsupported version %d\n",
+                    get32(t->io + 4));
+            goto fail;
+        }
+        t->format = TRACE_FORMAT_INDEXED;
+        t->codec = get32(t->io + 8);
+        t->io_pos = TRACE_HEADER_LEN;
+        trace_load_index(t);
+    } else {
+        t->format = TRACE_FORMAT_STREAM;
+        if ((magic & GZIP_MASK) == GZIP_MAGIC) {
+            t->codec = TRACE_CODEC_GZIP;
+        } else if (magic == ZSTD_MAGIC) {
+            t->codec = TRACE_CODEC_ZSTD;
+        } else if (magic == LZ4F_MAGIC) {
+            t->codec = TRACE_CODEC_LZ4;
+        } else {
+            t->codec = TRACE_CODEC_NONE;
+        }
+    }
+    if (!codec_init_read(t)) {
+        goto fail;
+    }
+#ifdef HAVE_PTHREAD
+    /* Read ahead from a pipe, if there is another CPU to do it on. */
+    if (!t->mapped && t->nindex == 0 && sysconf(_SC_NPROCESSORS_ONLN) > 1
+        && !trace_start_thread(t, trace_reader, TRACE_IO_SIZE,
+                               "readahead")) {
+        goto fail;
+    }
+#endif
+    return t;
+
+fail:
+    codec_free(t);
+#ifdef HAVE_PTHREAD
+    free(t->queue);
+    free(t->entry);
+#endif
+    trace_free_io(t);
+    free(t);
+    return NULL;
+}
+
+/* Decode up to len bytes of a stream into dst. Returns the number of
+ * bytes (fewer only at the end of the stream), or -1 on error.
+ */
+static long trace_decode(trace_file_t *t, uint8_t *dst, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len && !t->done) {
+        const uint8_t *src;
+        size_t avail;
+
+        if (t->io_pos == t->io_len) {
+            if (!trace_fill(t, 1)) {
+                return -1;
+            }
+            if (t->io_pos == t->io_len) {
+                break;
+            }
+        }
+        src = t->io + t->io_pos;
+        avail = t->io_len - t->io_pos;
+
+        switch (t->codec) {
+#ifdef HAVE_ZLIB
+        case TRACE_CODEC_GZIP: {
+            int r;
+
+            t->zs.next_in = (Bytef *)src;
+            t->zs.avail_in = avail;
+            t->zs.next_out = dst + done;
+            t->zs.avail_out = len - done;
+            r = inflate(&t->zs, Z_NO_FLUSH);
+            if (r == Z_STREAM_END) {
+                t->done = true;
+            } else if (r != Z_OK && r != Z_BUF_ERROR) {
+                return -1;
+            }
+            t->io_pos += avail - t->zs.avail_in;
+            done = len - t->zs.avail_out;
+            break;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        case TRACE_CODEC_ZSTD: {
+            ZSTD_inBuffer in = { src, avail, 0 };
+            ZSTD_outBuffer out = { dst + done, len - done, 0 };
+
+            if (ZSTD_isError(ZSTD_decompressStream(t->zd, &out, &in))) {
+                return -1;
+            }
+            t->io_pos += in.pos;
+            done += out.pos;
+            break;
+        }
+#endif
+#ifdef HAVE_LZ4
+        case TRACE_CODEC_LZ4: {
+            size_t dlen = len - done, slen = avail;
+
+            if (LZ4F_isError(LZ4F_decompress(t->ld, dst + done, &dlen,
+                                             src, &slen, NULL))) {
+                return -1;
+            }
+            t->io_pos += slen;
+            done += dlen;
+            break;
+        }
+#endif
+        default:
+            if (avail > len - done) {
+                avail = len - done;
+            }
+            memcpy(dst + done, src, avail);
+            t->io_pos += avail;
+            done += avail;
+            break;
+        }
+    }
+    return done;
+}
+
+/* Make t->data the raw_len bytes of a frame, from the stored_len bytes
+ * of it at src.
+ */
+static bool trace_unpack_frame(trace_file_t *t, uint8_t *src,
+                               uint32_t stored_len, uint32_t raw_len)
+{
+    if (t->layout == TRACE_LAYOUT_COLUMNS) {
+        uint32_t size;
+
+        if (stored_len < 4) {
+            return false;
+        }
+        size = get32(src);
+        src += 4;
+        stored_len -= 4;
+        if (t->codec != TRACE_CODEC_NONE) {
+            trace_reserve(&t->cols, &t->cols_cap, size);
+            if (!codec_decompress_frame(t, t->cols, size, src, stored_len)) {
+                return false;
+            }
+            src = t->cols;
+        } else if (stored_len != size) {
+            return false;
+        }
+        trace_reserve(&t->frame, &t->frame_cap, raw_len);
+        t->data = t->frame;
+        return columns_decode(src, size, t->frame, raw_len);
+    }
+
+    if (stored_len == raw_len) {
+        t->data = src;
+        return true;
+    }
+    trace_reserve(&t->frame, &t->frame_cap, raw_len);
+    t->data = t->frame;
+    return codec_decompress_frame(t, t->frame, raw_len, src, stored_len);
+}
+
+/* Read and decompress the frame at the current file position. */
+static RisuResult trace_next_frame(trace_file_t *t)
+{
+    uint8_t hdr[TRACE_FRAME_LEN];
+    uint32_t raw_len, stored_len;
+    uint8_t *src;
+    long n;
+
+    if (t->nindex && t->frame_no == t->nindex) {
+        return RES_END;
+    }
+    n = read_full(t, hdr, sizeof(hdr));
+    if (n == 0) {
+        return RES_END;
+    }
+    if (n != sizeof(hdr)) {
+        return RES_BAD_IO;
+    }
+    if (get32(hdr) != TRACE_FRAME) {
+        /* Without an index, we only know we are past the last frame. */
+        return RES_END;
+    }
+    raw_len = get32(hdr + 4);
+    stored_len = get32(hdr + 8);
+
+    if (t->mapped) {
+        /* Use the data where it is, decompressing it if need be. */
+        if (t->io_len - t->io_pos < stored_len) {
+            return RES_BAD_IO;
+        }
+        src = t->io + t->io_pos;
+        t->io_pos += stored_len;
+    } else {
+        trace_reserve(&t->stored, &t->stored_cap, stored_len);
+        if (read_full(t, t->stored, stored_len) != stored_len) {
+            return RES_BAD_IO;
+        }
+        src = t->stored;
+    }
+    if (!trace_unpack_frame(t, src, stored_len, raw_len)) {
+        return RES_BAD_IO;
+    }
+    t->frame_len = raw_len;
+    t->frame_pos = 0;
+    t->frame_no++;
+    return RES_OK;
+}
+
+/* Read up to bytes of records. Returns the number read (fewer only at
+ * the end of the trace), or -1 on error.
+ */
+static long trace_read_some(trace_file_t *t, uint8_t *p, size_t bytes)
+{
+    size_t done = 0;
+    long n;
+
+    if (t->format != TRACE_FORMAT_INDEXED) {
+        return trace_decode(t, p, bytes);
+    }
+    while (done < bytes) {
+        if (t->frame_pos == t->frame_len) {
+            RisuResult res = trace_next_frame(t);
+            if (res == RES_END) {
+                break;
+            }
+            if (res != RES_OK) {
+                return -1;
+            }
+        }
+        n = t->frame_len - t->frame_pos;
+        if ((size_t)n > bytes - done) {
+            n = bytes - done;
+        }
+        memcpy(p + done, t->data + t->frame_pos, n);
+        t->frame_pos += n;
+        done += n;
+    }
+    return done;
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * The readahead thread.
+ *
+ * A trace that can't be mapped (one coming down a pipe, from a
+ * decompressor or over ssh, say) is read and decompressed by a thread
+ * of its own, a chunk at a time, while the code under test runs. It
+ * fills the same kind of queue as the writer thread empties.
+ */
+static void *trace_reader(void *opaque)
+{
+    trace_file_t *t = (trace_file_t *)opaque;
+    uint32_t tail = t->q_tail;
+    RisuResult res;
+
+    for (;;) {
+        long n = trace_read_some(t, t->entry, TRACE_IO_SIZE);
+
+        if (n <= 0) {
+            res = n == 0 ? RES_END : RES_BAD_IO;
+            break;
+        }
+        for (;;) {
+            uint32_t head = queue_load(&t->q_head);
+
+            if (queue_load(&t->q_stop)) {
+                return NULL;
+            }
+            if (TRACE_QUEUE_SIZE - (tail - head) >= (uint32_t)n) {
+                break;
+            }
+            queue_wait(&t->q_head, head, &t->q_wr_wait);
+        }
+        queue_copy_in(t, tail, t->entry, n);
+        tail += n;
+        queue_store(&t->q_tail, tail);
+        queue_wake(&t->q_tail, &t->q_rd_wait);
+    }
+    queue_store(&t->q_res, res);
+    queue_store(&t->q_closing, 1);
+    queue_store(&t->q_rd_wait, 1);
+    queue_wake(&t->q_tail, &t->q_rd_wait);
+    return NULL;
+}
+
+static RisuResult queue_read(trace_file_t *t, uint8_t *p, size_t bytes)
+{
+    uint32_t head = t->q_head;
+    size_t done = 0;
+
+    while (done < bytes) {
+        /* As in trace_writer(), closing goes first. */
+        uint32_t closing = queue_load(&t->q_closing);
+        uint32_t tail = queue_load(&t->q_tail);
+        uint32_t n = tail - head;
+
+        if (n == 0) {
+            if (closing) {
+                RisuResult res = (RisuResult)queue_load(&t->q_res);
+                return res == RES_END && done ? RES_BAD_IO : res;
+            }
+            queue_wait(&t->q_tail, tail, &t->q_rd_wait);
+            continue;
+        }
+        if (n > bytes - done) {
+            n = bytes - done;
+        }
+        queue_copy_out(t, head, p + done, n);
+        head += n;
+        done += n;
+        queue_store(&t->q_head, head);
+        queue_wake(&t->q_head, &t->q_wr_wait);
+    }
+    return RES_OK;
+}
+
+static void trace_stop_reader(trace_file_t *t)
+{
+    queue_store(&t->q_stop, 1);
+    queue_store(&t->q_wr_wait, 1);
+    queue_wake(&t->q_head, &t->q_wr_wait);
+    /* It may be waiting for a pipe that will never say any more. */
+    pthread_cancel(t->thread);
+    pthread_join(t->thread, NULL);
+    t->async = false;
+}
+#endif
+
+/* Read exactly bytes, returns RES_END if the trace ends cleanly first. */
+RisuResult trace_read(trace_file_t *t, void *ptr, size_t bytes)
+{
+    long n;
+
+#ifdef HAVE_PTHREAD
+    if (t->async) {
+        return queue_read(t, (uint8_t *)ptr, bytes);
+    }
+#endif
+    n = trace_read_some(t, (uint8_t *)ptr, bytes);
+    if (n == (long)bytes) {
+        return RES_OK;
+    }
+    return n == 0 ? RES_END : RES_BAD_IO;
+}
+
+/* Like trace_read(), but rather than copying the data, return where it
+ * is, if it is in memory already and aligned to align. The data may be
+ * modified, and stays valid until the next read. Returns NULL (having
+ * read nothing) if the data has to be copied after all.
+ */
+void *trace_view(trace_file_t *t, size_t bytes, size_t align)
+{
+    uint8_t *p;
+
+#ifdef HAVE_PTHREAD
+    if (t->async) {
+        return NULL;
+    }
+#endif
+    if (t->format == TRACE_FORMAT_INDEXED) {
+        /* A record never spans frames, so only its header can be the
+         * first read from a frame.
+         */
+        if (t->frame_len - t->frame_pos < bytes) {
+            return NULL;
+        }
+        p = t->data + t->frame_pos;
+        if ((uintptr_t)p & (align - 1)) {
+            return NULL;
+        }
+        t->frame_pos += bytes;
+        return p;
+    }
+
+    if (!t->mapped || t->codec != TRACE_CODEC_NONE
+        || t->io_len - t->io_pos < bytes) {
+        return NULL;
+    }
+    p = t->io + t->io_pos;
+    if ((uintptr_t)p & (align - 1)) {
+        return NULL;
+    }
+    t->io_pos += bytes;
+    return p;
+}
+
+int trace_format(trace_file_t *t)
+{
+    return t->format;
+}
+
+int trace_codec(trace_file_t *t)
+{
+    return t->codec;
+}
+
+int trace_frames(trace_file_t *t)
+{
+    return t->nindex;
+}
+
+const trace_frame_t *trace_frame(trace_file_t *t, int i)
+{
+    return i >= 0 && i < t->nindex ? &t->index[i] : NULL;
+}
+
+bool trace_chained(trace_file_t *t)
+{
+    return t->chained;
+}
+
+bool trace_setup_known(trace_file_t *t)
+{
+    return t->setup_known;
+}
+
+/* The frame holding checkpoint n, or -1. */
+int trace_find_checkpoint(trace_file_t *t, uint64_t n)
+{
+    int lo = 0, hi = t->nindex;
+
+    /* Find the last frame starting at or before n. */
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (t->index[mid].first <= n) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < t->nindex && n >= t->index[lo].first
+        && n - t->index[lo].first < t->index[lo].records) {
+        return lo;
+    }
+    return -1;
+}
+
+/* The first frame from frame on that has a checkpoint taken at
+ * image_offset, or -1.
+ */
+int trace_find_offset(trace_file_t *t, uint32_t image_offset, int frame)
+{
+    for (; frame >= 0 && frame < t->nindex; frame++) {
+        if (image_offset >= t->index[frame].min_pc
+            && image_offset <= t->index[frame].max_pc) {
+            return frame;
+        }
+    }
+    return -1;
+}
+
+/* Continue reading at the start of frame, whose first checkpoint is
+ * trace_frame(t, frame)->first.
+ */
+RisuResult trace_seek_frame(trace_file_t *t, int frame)
+{
+    long offset;
+
+    if (frame < 0 || frame >= t->nindex) {
+        return RES_BAD_IO;
+    }
+    offset = t->index[frame].offset;
+    if (!trace_at(t, offset)) {
+        return RES_BAD_IO;
+    }
+    t->frame_len = 0;
+    t->frame_pos = 0;
+    t->frame_no = frame;
+    return RES_OK;
+}
+
+/* Finish the trace and close it (and its file descriptor). */
+RisuResult trace_close(trace_file_t *t)
+{
+    RisuResult res = RES_OK;
+
+#ifdef HAVE_PTHREAD
+    if (t->async && t->writing) {
+        res = trace_stop_writer(t);
+    } else if (t->async) {
+        trace_stop_reader(t);
+    }
+    free(t->queue);
+    free(t->entry);
+#endif
+    if (t->writing && res == RES_OK) {
+        if (t->format == TRACE_FORMAT_INDEXED) {
+            res = trace_finish(t);
+        } else {
+            res = trace_encode(t, true);
+        }
+    }
+    if (close(t->fd) != 0 && t->writing) {
+        res = RES_BAD_IO;
+    }
+    codec_free(t);
+    trace_free_io(t);
+    free(t->frame);
+    free(t->stored);
+    free(t->cols);
+    free(t->marks);
+    free(t->index);
+    free(t);
+    return res;
+}
+
+/* Trace metadata */
+
+/* Convert the numbers of m between host and big endian (in either
+ * direction).
+ */
+void trace_meta_swap(trace_meta_t *m)
+{
+    uint32_t *w[] = {
+        &m->version, &m->big_endian, &m->reginfo_size, &m->memblock_len,
+        &m->options, &m->image_hash[0], &m->image_hash[1],
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(w) / sizeof(w[0]); i++) {
+        *w[i] = get32((const uint8_t *)w[i]);
+    }
+}
+
+/* Check that a trace described by m (in host order) can be read by
+ * this build, reporting why not.
+ */
+bool trace_meta_check(trace_meta_t *m)
+{
+    m->image_name[TRACE_META_NAME_LEN - 1] = 0;
+    m->arch_opts[TRACE_META_OPTS_LEN - 1] = 0;
+
+    if (m->version != TRACE_META_VERSION) {
+        fprintf(stderr, "Error: trace metadata version %u, expected %u\n",
+                m->version, TRACE_META_VERSION);
+    } else if (m->big_endian != (uint32_t)get_arch_big_endian()) {
+        fprintf(stderr, "Error: the trace was recorded with the other "
+                "architecture byte order\n");
+    } else if (m->reginfo_size != sizeof(struct reginfo)) {
+        fprintf(stderr, "Error: reginfo size mismatch (trace %u, here %u)\n",
+                m->reginfo_size, (uint32_t)sizeof(struct reginfo));
+    } else if (m->memblock_len != MEMBLOCKLEN) {
+        fprintf(stderr, "Error: memory block size mismatch "
+                "(trace %u, here %u)\n", m->memblock_len, MEMBLOCKLEN);
+    } else {
+        return true;
+    }
+    return false;
+}
+
+static const struct option *find_arch_opt(const char *name)
+{
+    const struct option *o;
+
+    for (o = arch_long_opts; o && o->name; o++) {
+        if (strcmp(o->name, name) == 0) {
+            return o;
+        }
+    }
+    return NULL;
+}
+
+/* Note option name with argument arg (or NULL) in m's architecture
+ * options, if it is one of them.
+ */
+void trace_meta_add_arch_opt(trace_meta_t *m, const char *name,
+                             const char *arg)
+{
+    size_t len = strlen(m->arch_opts);
+    size_t need = strlen(name) + 3 + (arg ? strlen(arg) + 1 : 0);
+
+    if (!find_arch_opt(name)) {
+        return;
+    }
+    if (len + need >= TRACE_META_OPTS_LEN) {
+        fprintf(stderr, "warning: too many architecture options to record "
+                "--%s in the trace\n", name);
+        return;
+    }
+    if (len) {
+        strcat(m->arch_opts, " ");
+    }
+    strcat(m->arch_opts, "--");
+    strcat(m->arch_opts, name);
+    if (arg) {
+        strcat(m->arch_opts, "=");
+        strcat(m->arch_opts, arg);
+    }
+}
+
+/* Apply the architecture options a trace was recorded with, as if they
+ * had been given on the command line.
+ */
+bool trace_meta_apply_arch_opts(const trace_meta_t *m)
+{
+    char opts[TRACE_META_OPTS_LEN];
+    const struct option *o;
+    char *p, *arg;
+
+    memcpy(opts, m->arch_opts, sizeof(opts));
+    opts[sizeof(opts) - 1] = 0;
+    for (p = strtok(opts, " "); p; p = strtok(NULL, " ")) {
+        if (strncmp(p, "--", 2) == 0) {
+            p += 2;
+        }
+        arg = strchr(p, '=');
+        if (arg) {
+            *arg++ = 0;
+        }
+        o = find_arch_opt(p);
+        if (!o || (o->has_arg == required_argument && !arg)) {
+            fprintf(stderr, "Error: the trace's architecture option --%s "
+                    "is not understood here\n", p);
+            return false;
+        }
+        if (o->flag) {
+            *o->flag = o->val;
+        } else {
+            process_arch_opt(o->val, arg);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,581 @@
+/******************************************************************************
+ * Copyright (c) 2026 risu contributors
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *****************************************************************************/
+
+/*
+ * risu-tracediff: compare two traces recorded with risu --master -t,
+ * one of them taken as the master and the other as the apprentice,
+ * without running anything. Records are checked the way a live
+ * apprentice checks them, with reginfo_is_eq() and the same arch
+ * options (masks, fp_opts and so on).
+ *
+ * Indexed traces are cut into chunks of frames that are compared by
+ * worker processes, one per CPU by default. The arch comparators keep
+ * state in globals (signal_count, their option masks), so workers are
+ * processes rather than threads. Each reports how its chunk went and
+ * then waits: the parent takes the reports in order, has the worker of
+ * the first chunk that failed print the details, and stops the rest.
+ *
+ * Before any of that, the frames' anchors are compared: the frames up
+ * to the last one whose anchors match hold the same records in both
+ * traces and needn't be read at all. So identical traces only have
+ * their last frame compared, and different ones from the first frame
+ * that differs.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "risu.h"
+
+enum {
+    MASTER = 0, APPRENTICE = 1
+};
+
+#define MAX_JOBS 64
+
+/* The traces being compared, and their current records */
+static const char *trace_fn[2];
+static trace_record_t traces[2];
+
+/* How a chunk went, as sent from a worker to the parent */
+typedef struct {
+    int32_t res;            /* RES_OK if the whole chunk matched */
+    int32_t side;           /* the trace that an error is about */
+    uint64_t n;             /* checkpoint where it stopped */
+    int32_t setup;          /* whether the chunk ends in setup code */
+    int32_t seen_setup;     /* a setup op was seen in the chunk */
+} chunk_result_t;
+
+typedef struct {
+    uint64_t first, end;    /* checkpoint range */
+    bool setup;             /* whether first is in setup code */
+    int pid;
+    int res_fd;             /* chunk_result_t from the worker */
+    int go_fd;              /* a byte tells the worker to report */
+} chunk_t;
+
+static const char *side_name[2] = { "master", "apprentice" };
+
+/* Compare the current records, as recv_and_compare_register_info() in
+ * the apprentice would.
+ */
+static RisuResult compare_records(trace_record_t *m, trace_record_t *a,
+                                  bool *is_setup)
+{
+    int32_t mop = m->header.risu_op, op = a->header.risu_op;
+
+    switch (op) {
+    case OP_COMPARE:
+    case OP_TESTEND:
+    case OP_SIGILL:
+        if (mop != OP_COMPARE && mop != OP_TESTEND && mop != OP_SIGILL) {
+            return RES_MISMATCH_OP;
+        } else if (!*is_setup && !reginfo_is_eq(m->ri, a->ri)) {
+            return RES_MISMATCH_REG;
+        } else if (op != mop) {
+            return RES_MISMATCH_OP;
+        }
+        return op == OP_TESTEND ? RES_END : RES_OK;
+
+    case OP_COMPAREMEM:
+        if (op != mop) {
+            return RES_MISMATCH_OP;
+        }
+        return memcmp(a->mem, m->mem, MEMBLOCKLEN) ? RES_MISMATCH_MEM
+                                                   : RES_OK;
+
+    case OP_SETUPBEGIN:
+    case OP_SETUPEND:
+        if (op != mop) {
+            return RES_MISMATCH_OP;
+        }
+        *is_setup = op == OP_SETUPBEGIN;
+        return RES_OK;
+
+    default:
+        return op != mop ? RES_MISMATCH_OP : RES_OK;
+    }
+}
+
+/* Move a trace on to checkpoint n, through the index if it has one. */
+static RisuResult skip_to(trace_record_t *d, uint64_t n)
+{
+    RisuResult res = RES_OK;
+    uint64_t i = 0;
+
+    if (trace_frames(d->t) > 0) {
+        int frame = trace_find_checkpoint(d->t, n);
+
+        if (frame < 0 || trace_seek_frame(d->t, frame) != RES_OK) {
+            return RES_BAD_IO;
+        }
+        /* Whatever tool_open_trace() read ahead, we are elsewhere now. */
+        d->pending = false;
+        i = trace_frame(d->t, frame)->first;
+    }
+    for (; res == RES_OK && i < n; i++) {
+        res = tool_read_record(d);
+    }
+    return res;
+}
+
+/* Read the next record of both traces, or note which one failed. */
+static RisuResult read_records(chunk_result_t *r)
+{
+    RisuResult res = RES_OK;
+    int side;
+
+    for (side = MASTER; res == RES_OK && side <= APPRENTICE; side++) {
+        r->side = side;
+        res = tool_read_record(&traces[side]);
+    }
+    return res;
+}
+
+/* Compare checkpoints first to end (exclusive) of the two traces,
+ * starting in setup code if is_setup.
+ */
+static void diff_chunk(uint64_t first, uint64_t end, bool is_setup,
+                       chunk_result_t *r)
+{
+    RisuResult res = RES_OK;
+    uint64_t n = first;
+    int side;
+
+    memset(r, 0, sizeof(*r));
+    for (side = MASTER; res == RES_OK && side <= APPRENTICE; side++) {
+        r->side = side;
+        res = skip_to(&traces[side], first);
+    }
+    while (res == RES_OK && n < end) {
+        res = read_records(r);
+        if (res != RES_OK) {
+            break;
+        }
+        switch (traces[MASTER].header.risu_op) {
+        case OP_SETUPBEGIN:
+        case OP_SETUPEND:
+            r->seen_setup = true;
+            break;
+        }
+        /* For the arch code, e.g. to let a first mismatch slide */
+        signal_count = n + 1;
+        res = compare_records(&traces[MASTER], &traces[APPRENTICE],
+                              &is_setup);
+        if (res == RES_OK) {
+            n++;
+        }
+    }
+    r->res = res;
+    r->n = n;
+    r->setup = is_setup;
+}
+
+/* Whether checkpoint n of the master trace is in setup code, from its
+ * ops since the start. Only for traces older than the setup bytes in
+ * the index, when the comparison starts after frames skipped by their
+ * anchors.
+ */
+static bool setup_at(uint64_t n)
+{
+    trace_record_t *m = &traces[MASTER];
+    bool is_setup = false;
+    uint64_t i;
+
+    if (n == 0 || skip_to(m, 0) != RES_OK) {
+        return false;
+    }
+    for (i = 0; i < n && tool_read_record(m) == RES_OK; i++) {
+        switch (m->header.risu_op) {
+        case OP_SETUPBEGIN:
+        case OP_SETUPEND:
+            is_setup = m->header.risu_op == OP_SETUPBEGIN;
+            break;
+        }
+    }
+    return is_setup;
+}
+
+/* Whether frame i of the master trace starts in setup code, if its
+ * index says.
+ */
+static bool frame_setup(int i)
+{
+    trace_file_t *mt = traces[MASTER].t;
+
+    return trace_setup_known(mt) && trace_frame(mt, i)->setup;
+}
+
+static bool frames_match(int i)
+{
+    const trace_frame_t *m = trace_frame(traces[MASTER].t, i);
+    const trace_frame_t *a = trace_frame(traces[APPRENTICE].t, i);
+
+    return m->first == a->first && m->records == a->records
+           && m->chain == a->chain;
+}
+
+/* The frame to start comparing at: the first one whose anchors differ,
+ * found by binary search (once the chains part they stay apart), but
+ * at most the last one, to see how the traces end.
+ */
+static int first_frame(void)
+{
+    trace_file_t *mt = traces[MASTER].t, *at = traces[APPRENTICE].t;
+    int lo = 0, hi = trace_frames(mt);
+
+    if (!trace_chained(mt) || !trace_chained(at)) {
+        return 0;
+    }
+    if (trace_frames(at) < hi) {
+        hi = trace_frames(at);
+    }
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (frames_match(mid)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo > 0 && lo == trace_frames(mt)) {
+        lo--;
+    }
+    return lo;
+}
+
+static void report(const chunk_result_t *r)
+{
+    trace_record_t *m = &traces[MASTER], *a = &traces[APPRENTICE];
+    const char *name = side_name[r->side];
+
+    switch (r->res) {
+    case RES_OK:
+    case RES_END:
+        fprintf(stderr, "done after %" PRIu64 " checkpoints\n", r->n + 1);
+        return;
+    case RES_MISMATCH_REG:
+        fprintf(stderr, "Mismatch reg");
+        break;
+    case RES_MISMATCH_MEM:
+        fprintf(stderr, "Mismatch mem");
+        break;
+    case RES_MISMATCH_OP:
+        fprintf(stderr, "Mismatch header");
+        break;
+    case RES_BAD_MAGIC:
+        fprintf(stderr, "Unexpected magic number %#08x in %s trace",
+                traces[r->side].header.magic, name);
+        fprintf(stderr, " after %" PRIu64 " checkpoints\n", r->n);
+        return;
+    case RES_BAD_IO:
+        fprintf(stderr, "%s trace ends or can't be read", name);
+        fprintf(stderr, " after %" PRIu64 " checkpoints\n", r->n);
+        return;
+    default:
+        fprintf(stderr, "Bad record (size %u, opcode %d) in %s trace",
+                traces[r->side].header.size, traces[r->side].header.risu_op,
+                name);
+        fprintf(stderr, " after %" PRIu64 " checkpoints\n", r->n);
+        return;
+    }
+
+    fprintf(stderr, " at pc 0x%" PRIx64 " after %" PRIu64
+            " checkpoints\n", (uint64_t)m->header.pc, r->n + 1);
+    switch (r->res) {
+    case RES_MISMATCH_REG:
+        fprintf(stderr, "master reginfo:\n");
+        reginfo_dump(m->ri, stderr);
+        fprintf(stderr, "apprentice reginfo:\n");
+        reginfo_dump(a->ri, stderr);
+        reginfo_dump_mismatch(m->ri, a->ri, stderr);
+        break;
+    case RES_MISMATCH_OP:
+        fprintf(stderr, "mismatch detail (master : apprentice):\n"
+                        "  opcode: %s vs %s\n",
+                tool_op_name(m->header.risu_op),
+                tool_op_name(a->header.risu_op));
+        break;
+    }
+}
+
+static bool open_traces(void)
+{
+    int side;
+
+    for (side = MASTER; side <= APPRENTICE; side++) {
+        if (!tool_open_trace(&traces[side], trace_fn[side])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Check that the traces are of the same image, and unless given some,
+ * take the architecture options the master trace was recorded with.
+ */
+static bool check_metadata(bool have_arch_opts)
+{
+    trace_meta_t *m = &traces[MASTER].meta, *a = &traces[APPRENTICE].meta;
+
+    if (!traces[MASTER].has_meta) {
+        return true;
+    }
+    if (traces[APPRENTICE].has_meta
+        && (m->image_hash[0] != a->image_hash[0]
+            || m->image_hash[1] != a->image_hash[1])) {
+        fprintf(stderr, "Error: the traces are of different images "
+                "(%s, %s)\n", m->image_name, a->image_name);
+        return false;
+    }
+    if (have_arch_opts || !m->arch_opts[0]) {
+        return true;
+    }
+    fprintf(stderr, "using the master trace's options %s\n", m->arch_opts);
+    return trace_meta_apply_arch_opts(m);
+}
+
+static void close_traces(void)
+{
+    int side;
+
+    for (side = MASTER; side <= APPRENTICE; side++) {
+        if (traces[side].t) {
+            trace_close(traces[side].t);
+            traces[side].t = NULL;
+        }
+    }
+}
+
+/* Fork a worker for chunk c. It opens the traces for itself, so that it
+ * doesn't share file offsets with anybody.
+ */
+static bool start_worker(chunk_t *c)
+{
+    int res_pipe[2], go_pipe[2];
+
+    if (pipe(res_pipe) != 0 || pipe(go_pipe) != 0) {
+        perror("pipe");
+        return false;
+    }
+    c->pid = fork();
+    if (c->pid < 0) {
+        perror("fork");
+        return false;
+    }
+    if (c->pid == 0) {
+        chunk_result_t r;
+        char go;
+
+        close(res_pipe[0]);
+        close(go_pipe[1]);
+        close_traces();
+        if (!open_traces()) {
+            _exit(EXIT_FAILURE);
+        }
+        diff_chunk(c->first, c->end, c->setup, &r);
+        if (write(res_pipe[1], &r, sizeof(r)) == sizeof(r)
+            && read(go_pipe[0], &go, 1) == 1) {
+            report(&r);
+        }
+        _exit(EXIT_SUCCESS);
+    }
+    close(res_pipe[1]);
+    close(go_pipe[0]);
+    c->res_fd = res_pipe[0];
+    c->go_fd = go_pipe[1];
+    return true;
+}
+
+static void stop_worker(chunk_t *c, bool report)
+{
+    if (report && write(c->go_fd, "", 1) != 1) {
+        perror("write");
+    }
+    close(c->go_fd);
+    close(c->res_fd);
+    if (!report) {
+        kill(c->pid, SIGKILL);
+    }
+    waitpid(c->pid, NULL, 0);
+}
+
+/* Cut the traces from frame start on into njobs chunks of whole frames
+ * of the master trace and compare them in parallel. Returns the result
+ * of the first chunk that didn't match, which has been reported.
+ */
+static RisuResult diff_parallel(int njobs, int start)
+{
+    trace_file_t *mt = traces[MASTER].t;
+    int nframes = trace_frames(mt) - start;
+    chunk_t chunks[MAX_JOBS];
+    chunk_result_t r;
+    bool setup;
+    int i, j;
+
+    for (i = 0; i < njobs; i++) {
+        int frame = start + i * nframes / njobs;
+
+        chunks[i].first = trace_frame(mt, frame)->first;
+        chunks[i].end = UINT64_MAX;
+        chunks[i].setup = frame_setup(frame);
+        if (i > 0) {
+            chunks[i - 1].end = chunks[i].first;
+        }
+    }
+    /*
+     * The first chunk needs to start in the right state, or one that
+     * ends without setup ops hands the wrong one on.
+     */
+    if (start > 0 && !trace_setup_known(mt)) {
+        chunks[0].setup = setup_at(chunks[0].first);
+    }
+    setup = chunks[0].setup;
+    for (i = 0; i < njobs; i++) {
+        if (!start_worker(&chunks[i])) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    r.res = RES_BAD_IO;
+    for (i = 0; i < njobs; i++) {
+        if (read(chunks[i].res_fd, &r, sizeof(r)) != sizeof(r)) {
+            fprintf(stderr, "worker for checkpoint %" PRIu64 " failed\n",
+                    chunks[i].first);
+            r.res = RES_BAD_IO;
+            stop_worker(&chunks[i], false);
+            break;
+        }
+        if (setup != chunks[i].setup) {
+            /* The worker started the chunk in the wrong state. */
+            stop_worker(&chunks[i], false);
+            diff_chunk(chunks[i].first, chunks[i].end, setup, &r);
+            if (r.res != RES_OK) {
+                report(&r);
+                break;
+            }
+        } else {
+            stop_worker(&chunks[i], r.res != RES_OK);
+            if (r.res != RES_OK) {
+                break;
+            }
+        }
+        if (r.seen_setup) {
+            setup = r.setup;
+        }
+    }
+    for (j = i + 1; j < njobs; j++) {
+        stop_worker(&chunks[j], false);
+    }
+    return (RisuResult)r.res;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: risu-tracediff [options] master.trace apprentice.trace\n"
+            "\n"
+            "Compare a trace against a master (golden) trace, the way a "
+            "risu apprentice\n"
+            "playing back the master trace would, without running "
+            "anything.\n"
+            "\n"
+            "Options:\n"
+            "  -j N, --jobs=N    Compare with N worker processes "
+            "(default: one per CPU)\n");
+    if (arch_extra_help) {
+        fprintf(stderr, "%s", arch_extra_help);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option default_longopts[] = {
+        {"help", no_argument, 0, '?'},
+        {"jobs", required_argument, 0, 'j'},
+        {0, 0, 0, 0}
+    };
+    struct option *longopts = tool_options(default_longopts);
+    long njobs = sysconf(_SC_NPROCESSORS_ONLN);
+    bool have_arch_opts = false;
+    RisuResult res;
+    int nframes, start;
+
+    for (;;) {
+        int c = getopt_long(argc, argv, "j:", longopts, 0);
+
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case 0:
+            /* an architecture flag, set by getopt_long */
+            have_arch_opts = true;
+            break;
+        case 'j':
+            njobs = strtol(optarg, 0, 10);
+            break;
+        case '?':
+            usage();
+            return EXIT_FAILURE;
+        default:
+            if (c >= FIRST_ARCH_OPT) {
+                process_arch_opt(c, optarg);
+                have_arch_opts = true;
+                break;
+            }
+            abort();
+        }
+    }
+    free(longopts);
+    if (argc - optind != 2) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    trace_fn[MASTER] = argv[optind];
+    trace_fn[APPRENTICE] = argv[optind + 1];
+    if (!open_traces() || !check_metadata(have_arch_opts)) {
+        return EXIT_FAILURE;
+    }
+
+    /* Only indexed traces can be cut into chunks. */
+    start = first_frame();
+    nframes = trace_frames(traces[MASTER].t) - start;
+    if (trace_frames(traces[APPRENTICE].t) == 0) {
+        njobs = 1;
+    } else if (njobs > nframes) {
+        njobs = nframes;
+    }
+    if (njobs > MAX_JOBS) {
+        njobs = MAX_JOBS;
+    }
+
+    if (njobs > 1) {
+        res = diff_parallel(njobs, start);
+    } else {
+        uint64_t first = start ? trace_frame(traces[MASTER].t, start)->first
+                               : 0;
+        chunk_result_t r;
+
+        diff_chunk(first, UINT64_MAX, frame_setup(start), &r);
+        if (r.res == RES_MISMATCH_REG && first > 0
+            && !trace_setup_known(traces[MASTER].t)) {
+            /* setup_at() moves the master trace on, so look again. */
+            diff_chunk(first, UINT64_MAX, setup_at(first), &r);
+        }
+        report(&r);
+        res = (RisuResult)r.res;
+    }
+    close_traces();
+    return res == RES_END ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,315 @@
+/******************************************************************************
+ * Copyright (c) 2026 risu contributors
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *****************************************************************************/
+
+/*
+ * risu-trace: say what is in traces without playing them back.
+ *
+ * Each trace is read through once, the way an apprentice would read it
+ * but without any comparisons, and summarised: checkpoints and ops,
+ * how often each 32-bit word of the register info changed from one
+ * record to the next, and the most frequent instruction words.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "risu.h"
+
+#define REGINFO_WORDS ((sizeof(struct reginfo) + 3) / 4)
+#define NOPS (OP_SETUPEND + 1)
+
+/* A histogram of instruction words, as an open addressed hash table */
+typedef struct {
+    uint64_t *key;
+    uint64_t *count;
+    size_t size, used;
+} insn_hist_t;
+
+typedef struct {
+    uint64_t records;       /* all of them */
+    uint64_t selected;      /* those in the offset range */
+    uint64_t ops[NOPS + 1]; /* indexed by op + 1, for OP_SIGILL */
+    uint64_t pairs;         /* reginfos with one before them to compare */
+    uint64_t changes[REGINFO_WORDS];
+    uint32_t prev[REGINFO_WORDS];   /* the last reginfo counted */
+    size_t prev_words;
+    insn_hist_t faulting;
+    insn_hist_t prev_insn;
+} trace_stats_t;
+
+static arch_ptr_t offset_lo = 0, offset_hi = (arch_ptr_t)-1;
+static int top = 16;
+
+/* The slot for key, which is free if key isn't there yet */
+static size_t hist_slot(insn_hist_t *h, uint64_t key)
+{
+    size_t i = (key * 0x9e3779b97f4a7c15ull) >> 40 & (h->size - 1);
+
+    while (h->count[i] && h->key[i] != key) {
+        i = (i + 1) & (h->size - 1);
+    }
+    return i;
+}
+
+static void hist_add(insn_hist_t *h, uint64_t key)
+{
+    size_t i;
+
+    if (2 * (h->used + 1) > h->size) {
+        insn_hist_t old = *h;
+
+        h->size = h->size ? 2 * h->size : 1024;
+        h->key = (uint64_t *)calloc(h->size, sizeof(uint64_t));
+        h->count = (uint64_t *)calloc(h->size, sizeof(uint64_t));
+        if (!h->key || !h->count) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < old.size; i++) {
+            if (old.count[i]) {
+                size_t j = hist_slot(h, old.key[i]);
+
+                h->key[j] = old.key[i];
+                h->count[j] = old.count[i];
+            }
+        }
+        free(old.key);
+        free(old.count);
+    }
+    i = hist_slot(h, key);
+    if (!h->count[i]) {
+        h->key[i] = key;
+        h->used++;
+    }
+    h->count[i]++;
+}
+
+static void hist_free(insn_hist_t *h)
+{
+    free(h->key);
+    free(h->count);
+}
+
+static insn_hist_t *sort_hist;
+
+static int by_count(const void *a, const void *b)
+{
+    uint64_t ca = sort_hist->count[*(const size_t *)a];
+    uint64_t cb = sort_hist->count[*(const size_t *)b];
+
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+static void print_hist(const char *what, insn_hist_t *h, uint64_t total)
+{
+    size_t *slot, i, n = 0;
+
+    if (!h->used) {
+        return;
+    }
+    slot = (size_t *)malloc(h->used * sizeof(size_t));
+    for (i = 0; i < h->size; i++) {
+        if (h->count[i]) {
+            slot[n++] = i;
+        }
+    }
+    sort_hist = h;
+    qsort(slot, n, sizeof(size_t), by_count);
+    printf("  %s (%zu different):\n", what, n);
+    for (i = 0; i < n && i < (size_t)top; i++) {
+        printf("    0x%08" PRIx64 " %12" PRIu64 " %5.1f%%\n",
+               h->key[slot[i]], h->count[slot[i]],
+               100.0 * h->count[slot[i]] / total);
+    }
+    free(slot);
+}
+
+static void count_record(trace_stats_t *s, trace_record_t *r)
+{
+    int op = r->header.risu_op;
+    uint32_t cur[REGINFO_WORDS];
+    size_t words, i;
+
+    s->selected++;
+    s->ops[op + 1]++;
+    if (op != OP_COMPARE && op != OP_TESTEND && op != OP_SIGILL) {
+        return;
+    }
+
+    words = (r->header.size + 3) / 4;
+    memset(cur, 0, sizeof(cur));
+    memcpy(cur, r->ri, r->header.size);
+    if (s->prev_words) {
+        s->pairs++;
+        for (i = 0; i < words; i++) {
+            s->changes[i] += i >= s->prev_words || cur[i] != s->prev[i];
+        }
+    }
+    memcpy(s->prev, cur, sizeof(cur));
+    s->prev_words = words;
+
+    hist_add(&s->faulting, r->ri->faulting_insn);
+#if defined(RISU_REGINFO_PPC64_H) || defined(RISU_DPPC)
+    /* The instruction under test is the one before the trap. */
+    hist_add(&s->prev_insn, r->ri->prev_insn);
+#endif
+}
+
+static RisuResult scan_trace(trace_record_t *r, trace_stats_t *s)
+{
+    RisuResult res;
+
+    while ((res = tool_read_record(r)) == RES_OK) {
+        s->records++;
+        if (r->header.pc >= offset_lo && r->header.pc <= offset_hi) {
+            count_record(s, r);
+        }
+        if (r->header.risu_op == OP_TESTEND) {
+            return RES_END;
+        }
+    }
+    return res;
+}
+
+static const char *format_name(int format)
+{
+    return format == TRACE_FORMAT_INDEXED ? "indexed" : "stream";
+}
+
+static bool trace_stats(const char *fn)
+{
+    trace_record_t r;
+    trace_stats_t s;
+    RisuResult res;
+    size_t i;
+    int op;
+
+    memset(&r, 0, sizeof(r));
+    memset(&s, 0, sizeof(s));
+    if (!tool_open_trace(&r, fn)) {
+        return false;
+    }
+    res = scan_trace(&r, &s);
+
+    printf("%s: %s, %s", fn, format_name(trace_format(r.t)),
+           trace_codec_name(trace_codec(r.t)));
+    if (trace_frames(r.t)) {
+        printf(", %d frames", trace_frames(r.t));
+    }
+    if (trace_chained(r.t) && trace_frames(r.t)) {
+        /* Traces of the same records end with the same anchor. */
+        printf(", anchor %016" PRIx64,
+               trace_frame(r.t, trace_frames(r.t) - 1)->chain);
+    }
+    printf("\n");
+    if (r.has_meta) {
+        printf("  image %s (hash %08x%08x)\n", r.meta.image_name,
+               r.meta.image_hash[0], r.meta.image_hash[1]);
+        if (r.meta.arch_opts[0]) {
+            printf("  recorded with %s\n", r.meta.arch_opts);
+        }
+    }
+    printf("  checkpoints %12" PRIu64 "\n", s.records);
+    if (offset_lo != 0 || offset_hi != (arch_ptr_t)-1) {
+        printf("  selected    %12" PRIu64 " (pc 0x%" PRIx64 "-0x%" PRIx64
+               ")\n", s.selected, (uint64_t)offset_lo, (uint64_t)offset_hi);
+    }
+    for (op = OP_SIGILL; op < NOPS; op++) {
+        if (s.ops[op + 1]) {
+            printf("  %-11s %12" PRIu64 "\n", tool_op_name(op),
+                   s.ops[op + 1]);
+        }
+    }
+    if (s.pairs) {
+        printf("  reginfo words that changed (offset, changes):\n");
+        for (i = 0; i < REGINFO_WORDS; i++) {
+            if (s.changes[i]) {
+                printf("    +0x%04zx %12" PRIu64 " %5.1f%%\n", i * 4,
+                       s.changes[i], 100.0 * s.changes[i] / s.pairs);
+            }
+        }
+    }
+    print_hist("faulting insns", &s.faulting, s.ops[OP_COMPARE + 1]
+               + s.ops[OP_TESTEND + 1] + s.ops[OP_SIGILL + 1]);
+    print_hist("insns before the trap", &s.prev_insn, s.ops[OP_COMPARE + 1]
+               + s.ops[OP_TESTEND + 1] + s.ops[OP_SIGILL + 1]);
+    if (res != RES_END) {
+        printf("  trace ends without TESTEND (%s)\n",
+               res == RES_BAD_IO ? "truncated" : "bad record");
+    }
+
+    hist_free(&s.faulting);
+    hist_free(&s.prev_insn);
+    trace_close(r.t);
+    return res == RES_END;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: risu-trace [options] trace...\n"
+            "\n"
+            "Print what risu traces hold: checkpoints, ops, how often each "
+            "word of the\n"
+            "register info changes and the most frequent instruction "
+            "words.\n"
+            "\n"
+            "Options:\n"
+            "  --offset=A[-B]    Only count records taken at image offsets "
+            "A to B\n"
+            "  --top=N           List the N most frequent instruction words "
+            "(default 16)\n");
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option longopts[] = {
+        {"help", no_argument, 0, '?'},
+        {"offset", required_argument, 0, 'o'},
+        {"top", required_argument, 0, 'n'},
+        {0, 0, 0, 0}
+    };
+    int result = EXIT_SUCCESS;
+    char *end;
+
+    for (;;) {
+        int c = getopt_long(argc, argv, "", longopts, 0);
+
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case 'o':
+            offset_lo = offset_hi = (arch_ptr_t)strtoull(optarg, &end, 0);
+            if (*end == '-') {
+                offset_hi = (arch_ptr_t)strtoull(end + 1, 0, 0);
+            }
+            break;
+        case 'n':
+            top = strtol(optarg, 0, 10);
+            break;
+        case '?':
+            usage();
+            return EXIT_FAILURE;
+        default:
+            abort();
+        }
+    }
+    if (optind == argc) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    for (; optind < argc; optind++) {
+        if (!trace_stats(argv[optind])) {
+            result = EXIT_FAILURE;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,231 @@
+/******************************************************************************
+ * Copyright (c) 2026 risu contributors
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *****************************************************************************/
+
+/* Helpers shared by the offline trace tools (risu-tracediff, risu-trace) */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+
+#include "risu.h"
+#include "endianswap.h"
+
+/* What the arch code expects risu to provide; there is no image here. */
+RISU_TLS uintptr_t image_start_address;
+RISU_TLS entrypoint_fn *image_start;
+RISU_TLS size_t image_size;
+sig_handler_fn *sig_handler;
+RISU_TLS size_t signal_count;
+RISU_TLS size_t illegal_instructions;
+
+/* For checking that a struct reginfo in a trace can be used in place */
+struct reginfo_align {
+    char c;
+    struct reginfo ri;
+};
+#define REGINFO_ALIGN offsetof(struct reginfo_align, ri)
+
+static void header_to_host(trace_header_t *h)
+{
+    if (h->magic == BYTESWAP_32(RISU_MAGIC)) {
+        h->magic = (uint32_t)BYTESWAP_32(h->magic);
+        h->size = (uint32_t)BYTESWAP_32(h->size);
+        h->risu_op = (int32_t)BYTESWAP_32(h->risu_op);
+        if (sizeof(h->pc) == 8) {
+            h->pc = (arch_ptr_t)BYTESWAP_64((uint64_t)h->pc);
+        } else {
+            h->pc = (arch_ptr_t)BYTESWAP_32(h->pc);
+        }
+    }
+}
+
+/* Point at the next bytes of a trace where they are, or read them into
+ * buf. Returns NULL at the end of the trace.
+ */
+static void *read_view(trace_record_t *r, void *buf, size_t bytes,
+                       size_t align)
+{
+    void *p = trace_view(r->t, bytes, align);
+
+    if (p) {
+        return p;
+    }
+    return trace_read(r->t, buf, bytes) == RES_OK ? buf : NULL;
+}
+
+/* Read the metadata following r->header. */
+static bool read_meta(trace_record_t *r, trace_meta_t *m)
+{
+    if (r->header.size != sizeof(*m)
+        || trace_read(r->t, m, sizeof(*m)) != RES_OK) {
+        return false;
+    }
+    trace_meta_swap(m);
+    return true;
+}
+
+/* Open a trace for r, taking in its metadata if it starts with some. */
+bool tool_open_trace(trace_record_t *r, const char *fn)
+{
+    int fd = strcmp(fn, "-") == 0 ? STDIN_FILENO : open(fn, O_RDONLY);
+    trace_header_t *h = &r->header;
+
+    if (fd < 0) {
+        fprintf(stderr, "trace file \"%s\" cannot be opened\n", fn);
+        perror("open");
+        return false;
+    }
+    r->t = trace_open_read(fd);
+    if (!r->t) {
+        fprintf(stderr, "trace file \"%s\" cannot be read\n", fn);
+        return false;
+    }
+
+    /* An empty trace is left for tool_read_record() to report. */
+    r->has_meta = false;
+    r->pending = trace_read(r->t, h, sizeof(*h)) == RES_OK;
+    if (!r->pending) {
+        return true;
+    }
+    header_to_host(h);
+    if (h->magic != RISU_MAGIC || h->risu_op != OP_METADATA) {
+        return true;
+    }
+    r->pending = false;
+    if (!read_meta(r, &r->meta)) {
+        fprintf(stderr, "trace file \"%s\" has bad metadata\n", fn);
+    } else if (trace_meta_check(&r->meta)) {
+        if (!(r->meta.options & TRACE_META_DELTA)) {
+            r->has_meta = true;
+            return true;
+        }
+        fprintf(stderr, "trace file \"%s\" was recorded with --delta, "
+                "which only risu plays back\n", fn);
+    }
+    trace_close(r->t);
+    r->t = NULL;
+    return false;
+}
+
+/* Read the next record of a trace, checking it like an apprentice. */
+RisuResult tool_read_record(trace_record_t *r)
+{
+    trace_header_t *h = &r->header;
+    trace_meta_t m;
+
+    if (r->pending) {
+        r->pending = false;
+    } else {
+        if (trace_read(r->t, h, sizeof(*h)) != RES_OK) {
+            return RES_BAD_IO;
+        }
+        header_to_host(h);
+    }
+    if (h->magic != RISU_MAGIC) {
+        return RES_BAD_MAGIC;
+    }
+
+    switch (h->risu_op) {
+    case OP_METADATA:
+        /* Met again when reading from the first frame; not a record. */
+        if (!read_meta(r, &m)) {
+            return RES_BAD_SIZE_HEADER;
+        }
+        return tool_read_record(r);
+
+    case OP_COMPARE:
+    case OP_TESTEND:
+    case OP_SIGILL:
+        if (h->size > sizeof(struct reginfo)) {
+            return RES_BAD_SIZE_HEADER;
+        }
+        /* Converting in place takes a whole struct reginfo: a short
+         * one in the trace is followed by other records.
+         */
+        if (h->size == sizeof(struct reginfo)) {
+            r->ri = (struct reginfo *)read_view(r, &r->ri_buf, h->size,
+                                                REGINFO_ALIGN);
+        } else {
+            r->ri = trace_read(r->t, &r->ri_buf, h->size) == RES_OK
+                    ? &r->ri_buf : NULL;
+        }
+        if (!r->ri) {
+            return RES_BAD_IO;
+        }
+        reginfo_arch_to_host(r->ri);
+        if (h->size != (uint32_t)reginfo_size(r->ri)) {
+            return RES_BAD_SIZE_REGINFO;
+        }
+        return RES_OK;
+
+    case OP_COMPAREMEM:
+        if (h->size != MEMBLOCKLEN) {
+            return RES_BAD_SIZE_MEMBLOCK;
+        }
+        r->mem = (uint8_t *)read_view(r, r->mem_buf, MEMBLOCKLEN, 1);
+        return r->mem ? RES_OK : RES_BAD_IO;
+
+    case OP_SETMEMBLOCK:
+    case OP_GETMEMBLOCK:
+    case OP_SETUPBEGIN:
+    case OP_SETUPEND:
+        return h->size == 0 ? RES_OK : RES_BAD_SIZE_ZERO;
+
+    default:
+        return RES_BAD_OP;
+    }
+}
+
+const char *tool_op_name(int op)
+{
+    switch (op) {
+    case OP_METADATA:
+        return "METADATA";
+    case OP_SIGILL:
+        return "SIGILL";
+    case OP_COMPARE:
+        return "COMPARE";
+    case OP_TESTEND:
+        return "TESTEND";
+    case OP_SETMEMBLOCK:
+        return "SETMEMBLOCK";
+    case OP_GETMEMBLOCK:
+        return "GETMEMBLOCK";
+    case OP_COMPAREMEM:
+        return "COMPAREMEM";
+    case OP_SETUPBEGIN:
+        return "SETUPBEGIN";
+    case OP_SETUPEND:
+        return "SETUPEND";
+    }
+    return "unknown";
+}
+
+/* The long options opts, followed by the architecture's. */
+struct option *tool_options(const struct option *opts)
+{
+    const size_t osize = sizeof(struct option);
+    int count = 0, arch_count = 0;
+    struct option *lopts;
+
+    while (opts[count].name) {
+        count++;
+    }
+    while (arch_long_opts && arch_long_opts[arch_count].name) {
+        arch_count++;
+    }
+    lopts = (struct option *)calloc(count + arch_count + 1, osize);
+    memcpy(lopts, opts, count * osize);
+    if (arch_count) {
+        memcpy(lopts + count, arch_long_opts, arch_count * osize);
+    }
+    return lopts;
+}